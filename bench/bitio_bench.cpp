@@ -0,0 +1,44 @@
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "io.h"
+
+// measures bits per second of WStream::dump and RStream::extract on a field mix like the one of serialized trees:
+// split flags and leafs of brightness and match index
+int main(int argc, char** argv) {
+  int num_fields = argc > 1 ? std::stoi(argv[1]) : 1 << 22;
+  std::mt19937 gen{0};
+  std::vector<int> widths(num_fields);
+  std::vector<uint64_t> values(num_fields);
+  uint64_t total_bits = 0;
+  for (int i = 0; i < num_fields; ++i) {
+    widths[i] = i % 3 == 0 ? 1 : 8 + gen() % 18;
+    values[i] = gen() & ((uint64_t{1} << widths[i]) - 1);
+    total_bits += widths[i];
+  }
+
+  auto start = std::chrono::high_resolution_clock::now();
+  WStream wstream;
+  for (int i = 0; i < num_fields; ++i) {
+    wstream.dump(values[i], widths[i]);
+  }
+  auto written = std::chrono::high_resolution_clock::now();
+
+  RStream rstream{wstream.bytes()};
+  auto read_start = std::chrono::high_resolution_clock::now();
+  uint64_t mismatches = 0;
+  for (int i = 0; i < num_fields; ++i) {
+    mismatches += rstream.extract(widths[i]) != values[i];
+  }
+  auto read = std::chrono::high_resolution_clock::now();
+
+  auto write_time = std::chrono::duration<double>(written - start).count();
+  auto read_time = std::chrono::duration<double>(read - read_start).count();
+  std::cout << "fields: " << num_fields << ", bits: " << total_bits << "\n";
+  std::cout << "write: " << total_bits / write_time / 1e6 << " Mbit/s\n";
+  std::cout << "read: " << total_bits / read_time / 1e6 << " Mbit/s\n";
+  std::cout << "mismatches: " << mismatches << std::endl;
+  return mismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,264 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "header.h"
+#include "interface.h"
+#include "kernels.h"
+
+// times hot kernels of the codec on the luma of given images: every kernel is called until a repetition takes
+// kMinRepTime, then --reps repetitions of that many calls give mean, spread and minimum time per op. Throughput is
+// the bytes an op reads and writes over its mean time
+constexpr double kMinRepTime = 0.02;
+constexpr int kDefaultNumReps = 10;
+// "b" groups matched against every "a" group to get block errors for propagation kernels
+constexpr int kSetupBGroups = 64;
+constexpr int kBitioFields = 4096;
+
+namespace {
+
+struct Options {
+  std::string filter;
+  int num_reps = kDefaultNumReps;
+};
+
+void measure(const Options& options, const std::string& kernel, const std::string& input, double bytes_per_op,
+             int ops_per_call, const std::function<void()>& call) {
+  if (kernel.find(options.filter) == std::string::npos) {
+    return;
+  }
+  using Clock = std::chrono::steady_clock;
+  auto time = [&](int num_calls) {
+    auto start = Clock::now();
+    for (int i = 0; i < num_calls; ++i) {
+      call();
+    }
+    return std::chrono::duration<double>(Clock::now() - start).count();
+  };
+  int num_calls = 1;
+  for (double elapsed = time(num_calls); elapsed < kMinRepTime; elapsed = time(num_calls)) {
+    num_calls = elapsed > 0 ? std::max<int>(num_calls * 2, num_calls * kMinRepTime / elapsed * 1.2) : num_calls * 2;
+  }
+  std::vector<double> ns_per_op;
+  for (int rep = 0; rep < options.num_reps; ++rep) {
+    ns_per_op.push_back(time(num_calls) * 1e9 / num_calls / ops_per_call);
+  }
+  double mean = 0;
+  for (double ns : ns_per_op) {
+    mean += ns;
+  }
+  mean /= ns_per_op.size();
+  double variance = 0;
+  for (double ns : ns_per_op) {
+    variance += (ns - mean) * (ns - mean);
+  }
+  variance /= ns_per_op.size();
+  double min = *std::min_element(ns_per_op.begin(), ns_per_op.end());
+  std::printf("%-22s %-10s %14.1f ns/op  %8.2f GB/s  +-%5.2f%%  min %14.1f ns/op\n", kernel.c_str(), input.c_str(),
+              mean, bytes_per_op / mean, std::sqrt(variance) / mean * 100, min);
+}
+
+void benchBitio(const Options& options) {
+  std::mt19937 gen{0};
+  std::vector<int> widths(kBitioFields);
+  std::vector<uint64_t> values(kBitioFields);
+  double total_bits = 0;
+  for (int i = 0; i < kBitioFields; ++i) {
+    widths[i] = i % 3 == 0 ? 1 : 8 + gen() % 18;
+    values[i] = gen() & ((uint64_t{1} << widths[i]) - 1);
+    total_bits += widths[i];
+  }
+  double bytes_per_field = total_bits / CHAR_BIT / kBitioFields;
+  WStream written;
+  measure(options, "WStream::dump", "fields", bytes_per_field, kBitioFields, [&] {
+    WStream stream;
+    for (int i = 0; i < kBitioFields; ++i) {
+      stream.dump(values[i], widths[i]);
+    }
+    written = std::move(stream);
+  });
+  auto bytes = written.bytes();
+  uint64_t sink = 0;
+  measure(options, "RStream::extract", "fields", bytes_per_field, kBitioFields, [&] {
+    RStream stream{std::as_bytes(std::span{bytes})};
+    for (int i = 0; i < kBitioFields; ++i) {
+      sink += stream.extract(widths[i]);
+    }
+  });
+  if (sink == 1) {
+    std::printf("\n");
+  }
+}
+
+void benchImage(const Options& options, const std::string& path) {
+  // kernels are timed for the default block profile
+  constexpr int kProfile = kDefaultBlockProfile;
+  constexpr Size kMaximumBlockSize = kBlockProfiles[kProfile].max_size_;
+  constexpr int kMinBlockLevel = kBlockProfiles[kProfile].min_level_;
+  constexpr int kMaxBlockLevel = kBlockProfiles[kProfile].max_level_;
+  constexpr int kMaxBlockNumel = kBlockProfiles[kProfile].max_numel_;
+  constexpr int kMinBlocksInMax = kBlockProfiles[kProfile].min_blocks_in_max_;
+  constexpr int kNumBlockLevels = kMaxBlockLevel - kMinBlockLevel + 1;
+  Image img{path};
+  Size sz = img.size();
+  if (sz.first == 0 || sz.first % kMaximumBlockSize.first != 0 || sz.second % kMaximumBlockSize.second != 0) {
+    std::printf("skipping %s: shapes should be divisible by the maximum block size\n", path.c_str());
+    return;
+  }
+  std::string input = std::to_string(sz.first) + "x" + std::to_string(sz.second);
+  Channel chl = std::move(img.extractChannels()[0]);
+  chl.normalize();
+  Metadata metadata{sz, kProfile};
+  double channel_bytes = chl.numel() * sizeof(float);
+
+  Channel helper = chl.like();
+  measure(options, "downsampleTo", input, channel_bytes * 2, 1, [&] { chl.downsampleTo(helper); });
+  // kernels are set up with real data whichever of them are filtered out
+  chl.downsampleTo(helper);
+
+  auto groupOffsets = [](const std::vector<int>& block_offsets, int group) {
+    IVec offsets;
+    for (int vpos = 0; vpos < kVecNumel; ++vpos) {
+      offsets[vpos] = block_offsets[group * kVecNumel + vpos];
+    }
+    return offsets;
+  };
+  int num_a_groups = metadata.num_a_groups_;
+  auto a_groups = allocVecs(num_a_groups * kMaxBlockNumel);
+  auto a_mean = allocVecs(num_a_groups * kMinBlocksInMax * 2);
+  auto a_sumsq = allocVecs(num_a_groups * kMinBlocksInMax);
+  auto b_groups = allocVecs(kMaxBlockNumel);
+  auto b_mean = allocVecs(kMinBlocksInMax * 2);
+  auto b_sumsq = allocVecs(kMinBlocksInMax);
+  auto buf = allocVecs(kMinBlocksInMax * kVecNumel);
+  auto errors = allocVecs(num_a_groups * kMinBlocksInMax * 2);
+  auto matches = allocVecs<IVec>(num_a_groups * kMinBlocksInMax * 2);
+  IVec b_block_nums{};
+  for (int group = 0; group < num_a_groups; ++group) {
+    reorder<kProfile>(a_groups.get() + group * kMaxBlockNumel, chl.mem(), a_mean.get() + group * kMinBlocksInMax * 2,
+                      a_sumsq.get() + group * kMinBlocksInMax, metadata.pt_,
+                      groupOffsets(metadata.a_block_offsets_, group));
+  }
+
+  int group = 0;
+  double group_bytes = kMaxBlockNumel * kVecBytes;
+  double buf_bytes = kMinBlocksInMax * kVecNumel * kVecBytes;
+  measure(options, "reorder", input, group_bytes * 2, 1, [&] {
+    reorder<kProfile>(b_groups.get(), helper.mem(), b_mean.get(), b_sumsq.get(), metadata.pt_,
+                      groupOffsets(metadata.b_block_offsets_, group));
+    group = (group + 1) % metadata.num_b_groups_;
+  });
+  // kernels below cycle through "a" groups against the first "b" group
+  reorder<kProfile>(b_groups.get(), helper.mem(), b_mean.get(), b_sumsq.get(), metadata.pt_,
+                    groupOffsets(metadata.b_block_offsets_, 0));
+  group = 0;
+  measure(options, "matchGroup", input, group_bytes * 2 + buf_bytes, 1, [&] {
+    matchGroup<kProfile>(a_groups.get() + group * kMaxBlockNumel, b_groups.get(),
+                         a_sumsq.get() + group * kMinBlocksInMax, b_sumsq.get(), buf.get());
+    group = (group + 1) % num_a_groups;
+  });
+  matchGroup<kProfile>(a_groups.get(), b_groups.get(), a_sumsq.get(), b_sumsq.get(), buf.get());
+  group = 0;
+  measure(options, "reduce", input, buf_bytes, 1, [&] {
+    reduce<kProfile>(buf.get(), errors.get() + group * kMinBlocksInMax * 2, matches.get() + group * kMinBlocksInMax * 2,
+                     b_block_nums, a_mean.get() + group * kMinBlocksInMax * 2, b_mean.get());
+    group = (group + 1) % num_a_groups;
+  });
+
+  // block errors against "b" groups spread over the helper, so that coverings are shaped like real ones
+  std::fill_n(&errors.get()[0][0], num_a_groups * kMinBlocksInMax * 2 * kVecNumel, kInf);
+  int b_step = std::max(metadata.num_b_groups_ / kSetupBGroups, 1);
+  for (int b_group = 0; b_group < metadata.num_b_groups_; b_group += b_step) {
+    reorder<kProfile>(b_groups.get(), helper.mem(), b_mean.get(), b_sumsq.get(), metadata.pt_,
+                      groupOffsets(metadata.b_block_offsets_, b_group));
+    for (int a_group = 0; a_group < num_a_groups; ++a_group) {
+      matchGroup<kProfile>(a_groups.get() + a_group * kMaxBlockNumel, b_groups.get(),
+                           a_sumsq.get() + a_group * kMinBlocksInMax, b_sumsq.get(), buf.get());
+      reduce<kProfile>(buf.get(), errors.get() + a_group * kMinBlocksInMax * 2,
+                       matches.get() + a_group * kMinBlocksInMax * 2, b_block_nums,
+                       a_mean.get() + a_group * kMinBlocksInMax * 2, b_mean.get());
+    }
+  }
+  Storage<VecHolder<Vec>> coverings_errors;
+  Storage<VecHolder<IVec>> coverings_num_left_leafs;
+  for (int level = kMinBlockLevel; level <= kMaxBlockLevel; ++level) {
+    coverings_errors[level] = allocVecs(num_a_groups * kMinBlocksInMax);
+    coverings_num_left_leafs[level] = allocVecs<IVec>(num_a_groups * kMinBlocksInMax);
+  }
+  setupInnerPropagation<kProfile>(errors.get(), coverings_errors, num_a_groups);
+  measure(options, "propagateInner", input, kNumBlockLevels * num_a_groups * kMinBlocksInMax * kVecBytes * 2.0, 1,
+          [&] { propagateInner<kProfile>(coverings_errors, coverings_num_left_leafs, num_a_groups); });
+
+  // errors of maximum blocks by number of leafs, the instances the external propagation convolves
+  std::vector<std::vector<float>> curves;
+  for (int a_group = 0; a_group < num_a_groups; ++a_group) {
+    for (int vpos = 0; vpos < kVecNumel; ++vpos) {
+      auto& curve = curves.emplace_back(kMinBlocksInMax);
+      for (int num_leafs = 0; num_leafs < kMinBlocksInMax; ++num_leafs) {
+        curve[num_leafs] = coverings_errors[kMaxBlockLevel].get()[a_group * kMinBlocksInMax + num_leafs][vpos];
+      }
+    }
+  }
+  int curve_num = 0;
+  measure(options, "concave", input, kMinBlocksInMax * sizeof(float) * 2.0, 1, [&] {
+    auto shell = concave(curves[curve_num]);
+    curve_num = (curve_num + 1) % curves.size();
+  });
+  std::vector<float> convolution;
+  std::vector<int> best_left_indices;
+  measure(options, "minPlusConvolution", input, kMinBlocksInMax * sizeof(float) * 4.0, 1, [&] {
+    minPlusConvolution(curves[curve_num], curves[(curve_num + 1) % curves.size()], convolution, best_left_indices,
+                       kMinBlocksInMax * 2);
+    curve_num = (curve_num + 1) % curves.size();
+  });
+
+  if (std::string{"Decompressor::apply"}.find(options.filter) == std::string::npos) {
+    return;
+  }
+  // translations of the grayscale image coded at 1 bit per pixel
+  std::vector<Channel> gray;
+  gray.push_back(std::move(Image{path}.extractChannels()[0]));
+  auto stream_path = (std::filesystem::temp_directory_path() / "fcomp_bench_stream").string();
+  compressImage(Image{gray}, stream_path, chl.numel() / CHAR_BIT);
+  RStream stream{stream_path};
+  auto header = StreamHeader::read(stream);
+  Decompressor decomp{metadata, header->entropy_coded_};
+  RestoreParams params;
+  params.max_applies = 1;
+  decomp.decompress(stream, header->chunk_offsets_[0], header->rows_per_chunk_, params);
+  std::filesystem::remove(stream_path);
+  HelperImage src{sz, false};
+  src.downsampleRows(chl, 0, sz.first);
+  Channel dst = chl.like();
+  measure(options, "Decompressor::apply", input, channel_bytes * 2, 1, [&] { decomp.apply(dst, src); });
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options options;
+  std::vector<std::string> paths;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg.rfind("--filter=", 0) == 0) {
+      options.filter = arg.substr(9);
+    } else if (arg.rfind("--reps=", 0) == 0) {
+      options.num_reps = std::max(std::stoi(arg.substr(7)), 1);
+    } else {
+      paths.push_back(arg);
+    }
+  }
+  if (paths.empty()) {
+    paths = {"images/Lenna256.png", "images/BlueMarble320.png", "images/Lenna512.png"};
+  }
+  benchBitio(options);
+  for (const auto& path : paths) {
+    benchImage(options, path);
+  }
+}
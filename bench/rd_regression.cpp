@@ -0,0 +1,245 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "interface.h"
+#include "metrics.h"
+
+// codes every image of a directory at every byte budget and checks stream size, PSNR and encode and decode times
+// against a stored baseline. Times are the fastest of --runs runs. Decodes of a few milliseconds spread by about as
+// much between runs and machines, so slower times are only reported unless --time-tolerance is given, and even then
+// count as regressions only when they grow both relatively and by more than kMinTimeRegression
+constexpr int kDefaultBudgets[] = {1000, 2000, 4000, 8000, 14000};
+constexpr int kDefaultNumRuns = 3;
+constexpr float kDefaultPsnrTolerance = 0.02;
+constexpr float kDefaultSizeTolerance = 0.01;
+constexpr float kDefaultTimeTolerance = 0.5;
+constexpr double kMinTimeRegression = 0.01;
+
+namespace {
+
+struct Options {
+  std::string images_dir = "images";
+  std::vector<int> budgets{std::begin(kDefaultBudgets), std::end(kDefaultBudgets)};
+  int num_runs = kDefaultNumRuns;
+  bool subsample_chroma = false;
+  bool entropy_coded = false;
+  std::string baseline_path = "bench/rd_baseline.csv";
+  bool update_baseline = false;
+  std::string csv_path;
+  std::string json_path;
+  float psnr_tolerance = kDefaultPsnrTolerance;
+  float size_tolerance = kDefaultSizeTolerance;
+  float time_tolerance = kDefaultTimeTolerance;
+  // whether slower times count as regressions, set by --time-tolerance
+  bool check_times = false;
+};
+
+struct Point {
+  std::string image;
+  int budget = 0;
+  int bytes = 0;
+  double bpp = 0;
+  double psnr = 0;
+  double encode_time = 0;
+  double decode_time = 0;
+};
+
+Point measurePoint(const Options& options, const std::string& path, const Image& img, const QualityMeter& meter,
+                   int budget) {
+  auto stream_path = (std::filesystem::temp_directory_path() / "rd_regression.fcmp").string();
+  Point point{std::filesystem::path{path}.filename().string(), budget};
+  point.encode_time = point.decode_time = 1e9;
+  for (int run = 0; run < options.num_runs; ++run) {
+    auto start = std::chrono::steady_clock::now();
+    compressImage(img, stream_path, budget, false, options.subsample_chroma, options.entropy_coded);
+    auto encoded = std::chrono::steady_clock::now();
+    Image decoded = decompressImage(stream_path);
+    auto end = std::chrono::steady_clock::now();
+    point.encode_time = std::min(point.encode_time, std::chrono::duration<double>(encoded - start).count());
+    point.decode_time = std::min(point.decode_time, std::chrono::duration<double>(end - encoded).count());
+    if (run == 0) {
+      point.psnr = decoded.size() == img.size() ? meter.measure(decoded).psnr_ : 0;
+    }
+  }
+  point.bytes = std::filesystem::file_size(stream_path);
+  point.bpp = point.bytes * 8.0 / (img.size().first * img.size().second);
+  std::filesystem::remove(stream_path);
+  return point;
+}
+
+constexpr const char* kCsvHeader = "image,budget,bytes,bpp,psnr,encode_s,decode_s";
+
+bool saveCsv(const std::vector<Point>& points, const std::string& path) {
+  std::ofstream ofs{path};
+  ofs << kCsvHeader << "\n";
+  for (const auto& p : points) {
+    ofs << p.image << "," << p.budget << "," << p.bytes << "," << p.bpp << "," << p.psnr << "," << p.encode_time
+        << "," << p.decode_time << "\n";
+  }
+  return static_cast<bool>(ofs);
+}
+
+bool saveJson(const std::vector<Point>& points, const std::string& path) {
+  std::ofstream ofs{path};
+  ofs << "[";
+  for (int i = 0; i < points.size(); ++i) {
+    const auto& p = points[i];
+    ofs << (i > 0 ? "," : "") << "\n  {\"image\": \"" << p.image << "\", \"budget\": " << p.budget
+        << ", \"bytes\": " << p.bytes << ", \"bpp\": " << p.bpp << ", \"psnr\": " << p.psnr
+        << ", \"encode_s\": " << p.encode_time << ", \"decode_s\": " << p.decode_time << "}";
+  }
+  ofs << "\n]\n";
+  return static_cast<bool>(ofs);
+}
+
+// points of the baseline by image and budget, empty if there is no baseline
+std::map<std::pair<std::string, int>, Point> loadBaseline(const std::string& path) {
+  std::map<std::pair<std::string, int>, Point> baseline;
+  std::ifstream ifs{path};
+  std::string line;
+  std::getline(ifs, line);
+  while (std::getline(ifs, line)) {
+    std::replace(line.begin(), line.end(), ',', ' ');
+    std::istringstream fields{line};
+    Point p;
+    if (fields >> p.image >> p.budget >> p.bytes >> p.bpp >> p.psnr >> p.encode_time >> p.decode_time) {
+      baseline[{p.image, p.budget}] = p;
+    }
+  }
+  return baseline;
+}
+
+// prints every regression of the point against its baseline one, returns their number. Slower times are printed as
+// well, but counted only with check_times
+int compare(const Options& options, const Point& point, const Point& base) {
+  int num_regressions = 0;
+  auto report = [&](const char* what, double value, double base_value, bool counted = true) {
+    std::printf("%s %s at %d bytes: %s %.4f, baseline %.4f\n", counted ? "REGRESSION" : "slower", point.image.c_str(),
+                point.budget, what, value, base_value);
+    num_regressions += counted;
+  };
+  if (point.psnr < base.psnr - options.psnr_tolerance) {
+    report("PSNR", point.psnr, base.psnr);
+  }
+  // budgets below the size of base leafs are overshot, so the stream is held to the baseline's size rather than budget
+  if (point.bpp > base.bpp * (1 + options.size_tolerance)) {
+    report("bpp", point.bpp, base.bpp);
+  }
+  auto slower = [&](double time, double base_time) {
+    return time > base_time * (1 + options.time_tolerance) && time - base_time > kMinTimeRegression;
+  };
+  if (slower(point.encode_time, base.encode_time)) {
+    report("encode s", point.encode_time, base.encode_time, options.check_times);
+  }
+  if (slower(point.decode_time, base.decode_time)) {
+    report("decode s", point.decode_time, base.decode_time, options.check_times);
+  }
+  return num_regressions;
+}
+
+std::vector<int> parseBudgets(const std::string& list) {
+  std::vector<int> budgets;
+  std::istringstream items{list};
+  std::string item;
+  while (std::getline(items, item, ',')) {
+    budgets.push_back(std::stoi(item));
+  }
+  return budgets;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options options;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    auto value = [&](const std::string& option) {
+      return arg.rfind(option, 0) == 0 ? arg.substr(option.size()) : std::string{};
+    };
+    if (auto v = value("--images="); !v.empty()) {
+      options.images_dir = v;
+    } else if (auto v = value("--budgets="); !v.empty()) {
+      options.budgets = parseBudgets(v);
+    } else if (auto v = value("--runs="); !v.empty()) {
+      options.num_runs = std::max(std::stoi(v), 1);
+    } else if (arg == "--chroma420") {
+      options.subsample_chroma = true;
+    } else if (arg == "--entropy") {
+      options.entropy_coded = true;
+    } else if (auto v = value("--baseline="); !v.empty()) {
+      options.baseline_path = v;
+    } else if (arg == "--update-baseline") {
+      options.update_baseline = true;
+    } else if (auto v = value("--csv="); !v.empty()) {
+      options.csv_path = v;
+    } else if (auto v = value("--json="); !v.empty()) {
+      options.json_path = v;
+    } else if (auto v = value("--psnr-tolerance="); !v.empty()) {
+      options.psnr_tolerance = std::stof(v);
+    } else if (auto v = value("--size-tolerance="); !v.empty()) {
+      options.size_tolerance = std::stof(v);
+    } else if (auto v = value("--time-tolerance="); !v.empty()) {
+      options.time_tolerance = std::stof(v);
+      options.check_times = true;
+    } else {
+      std::printf("unknown argument %s\n", arg.c_str());
+      return 2;
+    }
+  }
+
+  std::vector<std::string> paths;
+  for (const auto& entry : std::filesystem::directory_iterator{options.images_dir}) {
+    paths.push_back(entry.path().string());
+  }
+  std::sort(paths.begin(), paths.end());
+
+  std::vector<Point> points;
+  std::printf("%-20s %8s %8s %8s %9s %10s %10s\n", "image", "budget", "bytes", "bpp", "PSNR", "encode s", "decode s");
+  for (const auto& path : paths) {
+    Image img{path};
+    if (img.size().first == 0) {
+      continue;
+    }
+    QualityMeter meter{img};
+    for (int budget : options.budgets) {
+      points.push_back(measurePoint(options, path, img, meter, budget));
+      const auto& p = points.back();
+      std::printf("%-20s %8d %8d %8.4f %9.4f %10.4f %10.4f\n", p.image.c_str(), p.budget, p.bytes, p.bpp, p.psnr,
+                  p.encode_time, p.decode_time);
+    }
+  }
+  if (!options.csv_path.empty() && !saveCsv(points, options.csv_path) ||
+      !options.json_path.empty() && !saveJson(points, options.json_path)) {
+    std::printf("can not write results\n");
+    return 2;
+  }
+  if (options.update_baseline) {
+    bool saved = saveCsv(points, options.baseline_path);
+    std::printf(saved ? "baseline %s updated\n" : "can not write baseline %s\n", options.baseline_path.c_str());
+    return saved ? 0 : 2;
+  }
+
+  auto baseline = loadBaseline(options.baseline_path);
+  if (baseline.empty()) {
+    std::printf("no baseline at %s, run with --update-baseline to store one\n", options.baseline_path.c_str());
+    return 2;
+  }
+  int num_regressions = 0;
+  int num_compared = 0;
+  for (const auto& point : points) {
+    auto it = baseline.find({point.image, point.budget});
+    if (it != baseline.end()) {
+      num_regressions += compare(options, point, it->second);
+      ++num_compared;
+    }
+  }
+  std::printf("%d of %zu points compared, %d regressions\n", num_compared, points.size(), num_regressions);
+  return num_regressions > 0 ? 1 : 0;
+}
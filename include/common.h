@@ -1,13 +1,21 @@
 #pragma once
 
+#include <utility>
 #include <vector>
 
 #include "utils.h"
 
+// rounds brightness to the coded range
+int clamp(float f);
+// brightness of a channel normalized by range from, normalized by range to instead. Restore is invariant to affine
+// maps of values, so leafs of a sequence frame are repeated in a frame of another range by renormalizing their
+// brightness
+int renormalize(int brightness, std::pair<int, int> from, std::pair<int, int> to);
+
 // blocks' base offsets in maximum block
 class Pattern {
 public:
-  Pattern(Size sz);
+  Pattern(Size sz, const BlockProfile& profile);
 
   const auto& operator[](int level) const { return pattern_[level]; }
 
@@ -18,14 +26,17 @@ private:
   void build(int level, int start, Offset ofs);
 
   Size sz_;
+  int min_level_;
   Storage<std::vector<int>> pattern_;
 };
 
 // common data based on image size that is used during both compression and decompression
 struct Metadata {
-  Metadata(Size sz);
+  Metadata(Size sz, int profile_num = kDefaultBlockProfile);
 
   Size sz_;
+  int profile_num_;
+  BlockProfile profile_;
   Pattern pt_;
 
   int num_a_blocks_;
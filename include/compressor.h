@@ -1,6 +1,5 @@
 #pragma once
 
-#include <chrono>
 #include <string>
 #include <vector>
 
@@ -8,12 +7,13 @@
 #include "image.h"
 #include "io.h"
 #include "propagation.h"
+#include "telemetry.h"
 #include "utils.h"
 
 // here and everywhere "a" is the reference channel and "b" is the helper channel
 class ReusableBuffers {
 public:
-  ReusableBuffers(int num_a_groups);
+  ReusableBuffers(int num_a_groups, const BlockProfile& profile);
 
   Vec* __restrict__ a_groups() { return a_groups_.get(); }
   Vec* __restrict__ b_groups() { return b_groups_.get(); }
@@ -30,30 +30,108 @@ public:
   VecHolder<Vec> b_sumsq_;
 };
 
+// what a channel of a sequence frame leaves for the next frame
+struct ChannelHistory {
+  struct Leaf {
+    int level_;
+    int ipos_;
+    int brightness_;
+    int match_;
+  };
+
+  // leafs every maximum block was last coded with
+  std::vector<std::vector<Leaf>> block_leafs_;
+  // their error over the frame they were coded for. Blocks repeating them keep it, so repeats can not drift away
+  std::vector<float> block_errors_;
+
+  bool empty() const { return block_leafs_.empty(); }
+  // moves leafs and errors of a channel normalized by range from to one normalized by range to
+  void renormalize(std::pair<int, int> from, std::pair<int, int> to);
+};
+
 // compresses one channel
 class Compressor {
 public:
-  Compressor(const Channel& chl, const Metadata& metadata, ReusableBuffers& buffers);
-
+  // channels of sequence frames pass the history of the previous frame, which the compressor reads and updateHistory
+  // then overwrites. Empty history makes an intra frame. domain is the helper of a shared dictionary matches are
+  // searched in instead of the channel's own one, see Dictionary
+  Compressor(const Channel& chl, const Metadata& metadata, ReusableBuffers& buffers, ChannelHistory* history = nullptr,
+             const Channel* domain = nullptr);
+
+  // downsamples the channel to its helper and picks maximum blocks still fitting the previous frame's leafs, before
+  // setupCompressionState
+  void setupHelper();
   std::vector<float> setupCompressionState(int target_num_leafs);
-  void serialize(int target_num_leafs, WStream& stream);
+  // errors of the frame coded with the previous frame's leafs and the errors those were coded with, summed over maximum
+  // blocks. Zeros for intra frames
+  std::pair<float, float> historyErrors() const;
+  // codes the frame on its own, updateHistory then replaces the whole history
+  void dropHistory();
+  // returns chunks of rows_per_chunk rows of maximum blocks
+  std::vector<std::vector<char>> serialize(int target_num_leafs, bool entropy_coded = false, int rows_per_chunk = 1);
+  // progressive layout: serializeBase writes raw leafs of all maximum blocks of the covering with target_num_leafs
+  // leafs. serializeRefinements then writes for every block of the level that is a leaf so far its split flag,
+  // followed by leafs of its children if it splits, their brightness coded as differences from the parent's
+  void serializeBase(int target_num_leafs, WStream& stream);
+  void serializeRefinements(int level, WStream& stream);
+  // records leafs of the last serialized covering in the history
+  void updateHistory();
+  // maximum blocks repeating the previous frame's leafs, empty for intra frames
+  const std::vector<bool>& sameBlocks() const { return same_blocks_; }
+  const Telemetry& telemetry() const { return telemetry_; }
   void reportTimings() const;
 
 private:
   // finds best covering of leafs for this channel
   void distributeLeafs(int target_num_leafs);
 
-  // serializes maximum blocks' coverings
-  void serializeNodes(WStream& stream, const std::vector<int>& leafs_per_block);
+  // serializes maximum blocks' coverings, one chunk per rows_per_chunk rows of them
+  std::vector<std::vector<char>> serializeNodes(const std::vector<int>& leafs_per_block, bool entropy_coded,
+                                                int rows_per_chunk);
 
-  // calculates best matches and associated errors for blocks of "a" and "b" channels
+  // calculates best matches and associated errors for blocks of "a" and "b" channels, with kernels of the block
+  // profile of the channel
   void matchBlocks();
+  template <int kProfile>
+  void matchBlocks();
+  // matches groups of "a" blocks against groups of "b" blocks where mask[a_group * num_b_groups_ + b_group] is set,
+  // against all of them for empty mask
+  template <int kProfile>
+  void matchGroups(const std::vector<char>& mask);
+  // marks groups of "b" blocks around the previous frame's matches of every group of "a" blocks
+  std::vector<char> seedMask() const;
+
+  // picks maximum blocks whose previous frame's leafs still fit the frame
+  void findSameBlocks();
+  // error of given leafs of a maximum block over the current frame
+  float leafsError(int block_num, const std::vector<ChannelHistory::Leaf>& leafs) const;
+  // whether error of a block coded with error reference_error is no worse than that up to the sequence slack
+  bool withinSlack(float error, float reference_error) const;
+  template <typename Writer>
+  void serializeBlock(Writer& writer, int block_num, int num_leafs);
 
   // calculates the minimum error between all block coverings for each block for each number of leafs
   std::vector<float> propagate(int target_num_leafs);
 
-  // serializes each block' coverings
-  void serializeNode(WStream& stream, int level, int vnum, int vpos, int ipos, int num_leafs);
+  // serializes each block' coverings with RawTreeWriter or EntropyTreeWriter, returns the split flag. sibling is the
+  // context of the split flag, see LeafCoder
+  template <typename Writer>
+  bool serializeNode(Writer& writer, int level, int vnum, int vpos, int ipos, int num_leafs, int sibling);
+  template <typename Writer>
+  void serializeLeaf(Writer& writer, int level, int block_num, int ipos);
+  // position of the subblock in a_mean and block_matches_indices_ vectors, its lane is block_num % kVecNumel
+  int leafIndex(int level, int block_num, int ipos) const;
+  // number of leafs of the left child of a subblock split into num_leafs + 1 leafs
+  int numLeafsInLeft(int level, int block_num, int ipos, int num_leafs) const;
+  // leafs of the covering serializeNode writes, in the same order
+  void collectLeafs(int level, int block_num, int ipos, int num_leafs, std::vector<ChannelHistory::Leaf>& leafs);
+
+  // subblock of the level being refined by progressive serialization, num_leafs as in serializeNode
+  struct FrontierNode {
+    int block_num_;
+    int ipos_;
+    int num_leafs_;
+  };
 
 private:
   Vec* a_groups() { return rbuf_.a_groups_.get(); }
@@ -65,10 +143,15 @@ private:
   Vec* a_sumsq() { return rbuf_.a_sumsq_.get(); }
   Vec* b_sumsq() { return rbuf_.b_sumsq_.get(); }
 
+  // channel matches are searched in
+  const Channel& helper() const { return domain_ != nullptr ? *domain_ : b_chl_; }
+
   const Channel& a_chl_;
   ReusableBuffers& rbuf_;
 
+  // own helper, not allocated when matching against a dictionary
   Channel b_chl_;
+  const Channel* domain_;
 
   const Metadata& metadata_;
 
@@ -80,13 +163,15 @@ private:
   Storage<VecHolder<IVec>> coverings_num_leafs_in_left_;
 
   Propagator propagator_;
+  std::vector<FrontierNode> frontier_;
+  // leafs of maximum blocks of the last serialized covering
+  std::vector<int> leafs_per_block_;
+
+  ChannelHistory* history_;
+  std::vector<bool> same_blocks_;
+  // errors of repeating previous frame's leafs in the current one
+  std::vector<float> same_errors_;
+  int num_full_search_groups_ = 0;
 
-  mutable std::chrono::duration<double> reorder_time_{0};
-  mutable std::chrono::duration<double> match_time_{0};
-  mutable std::chrono::duration<double> reduce_time_{0};
-  mutable std::chrono::duration<double> int_prop_time_{0};
-  mutable std::chrono::duration<double> ext_prop_time_{0};
-  mutable std::chrono::duration<double> total_setup_time_{0};
-  mutable std::chrono::duration<double> serialization_time_{0};
-  mutable std::chrono::duration<double> total_time_{0};
+  Telemetry telemetry_;
 };
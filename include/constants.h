@@ -1,6 +1,7 @@
 #pragma once
 
 #include <climits>
+#include <iterator>
 #include <limits>
 #include <utility>
 
@@ -15,18 +16,48 @@ constexpr int kBaseBlockLevel = 0;
 constexpr Size kBaseBlockSize = std::make_pair(1, 1);
 
 constexpr int kBitsForNumChannels = 2;
+constexpr int kBitsForChromaSubsampling = 1;
+constexpr int kBitsForEntropyCoding = 1;
+constexpr int kBitsForProgressive = 1;
+constexpr int kBitsForInterFrame = 1;
+constexpr int kBitsForDictionary = 1;
+constexpr int kBitsForDictionaryId = 32;
+constexpr int kBitsForNumApplies = 7;
+constexpr int kBitsForBlockProfile = 2;
+constexpr int kBitsForRowsPerChunk = 7;
+// longest zero prefix of Exp-Golomb codes, longer ones only come from reading past the end of a stream
+constexpr int kMaxSignedPrefix = 16;
 constexpr int kBitDepth = CHAR_BIT;
 
 // Changeable constants
-constexpr Size kMinimumBlockSize = std::make_pair(2, 2);
-constexpr Size kMaximumBlockSize = std::make_pair(32, 32);
-
 constexpr int kSearchStride = 1;
 constexpr float kAlpha = 0.75;
 constexpr int kBitsPerShape = 11;
 
 constexpr int kYChannelWeight = 4;
 constexpr int kNumApplies = 100;
+// entropy coded leafs are assumed to take no less than 1 / kMaxEntropyCodingGain of raw leaf bits
+constexpr int kMaxEntropyCodingGain = 2;
+// entropy coded chunks span rows of maximum blocks holding at least that many blocks, so that contexts restarted by
+// every chunk have enough leafs to adapt to
+constexpr int kMinEntropyChunkBlocks = 64;
+// order of Exp-Golomb codes of brightness differences of progressive refinements between a left child and its parent
+constexpr int kRefinementDeltaOrder = 4;
+// restore stops once no pixel changes more than that between iterations
+constexpr float kConvergenceMaxDelta = 0.05;
+// maximum block is still two helper rows high at the smallest decoding scale
+constexpr int kMaxScale = 8;
+// frames of a sequence: a block keeps the previous frame's leafs, or the matches found around them, while its error
+// stays within kSequenceErrorSlack times the one it was coded with plus kSequenceMseSlack per pixel
+constexpr float kSequenceErrorSlack = 1.1;
+constexpr float kSequenceMseSlack = 0.5;
+// matches are searched this many helper pixels around the previous frame's ones. Groups of blocks whose previous
+// coverings get more than kSeedErrorSlack times worse with them search the whole helper
+constexpr int kSeedRadius = 2;
+constexpr float kSeedErrorSlack = 1.25;
+// frames whose error with the previous frame's leafs exceeds kSceneCutErrorRatio times the error those were coded with
+// are scene cuts, coded as intra frames
+constexpr float kSceneCutErrorRatio = 4;
 
 // Checks
 constexpr bool isPowerOfTwo(unsigned int x) { return !(x & (x - 1)); }
@@ -35,12 +66,11 @@ constexpr int validateBlockSize(Size sz) {
   return isPowerOfTwo(sz.first) && sz.second == sz.first * 2 || sz.second == sz.first;
 }
 
-static_assert(validateBlockSize(kMinimumBlockSize));
-static_assert(validateBlockSize(kMaximumBlockSize));
-
 static_assert(isPowerOfTwo(kSearchStride));
 static_assert(kAlpha > 0 && kAlpha < 1);
 static_assert(isPowerOfTwo(kVecNumel));
+static_assert(kNumApplies < (1 << kBitsForNumApplies));
+static_assert(isPowerOfTwo(kMaxScale));
 
 constexpr int getBlockLevel(Size sz) {
   if (sz == kBaseBlockSize) {
@@ -71,15 +101,65 @@ constexpr int getBlockNumel(int level) {
   return sz.first * sz.second;
 }
 
-constexpr int kMinBlockLevel = getBlockLevel(kMinimumBlockSize);
-constexpr int kMaxBlockLevel = getBlockLevel(kMaximumBlockSize);
+// range of DuoTree block sizes. Match and propagation kernels are instantiated for every profile, the rest of the
+// codec takes the profile of the stream from Metadata
+struct BlockProfile {
+  Size min_size_;
+  Size max_size_;
+  int min_level_;
+  int max_level_;
+  int min_numel_;
+  int max_numel_;
+  int min_blocks_in_max_;
+};
+
+constexpr BlockProfile makeBlockProfile(Size min_size, Size max_size) {
+  int min_level = getBlockLevel(min_size);
+  int max_level = getBlockLevel(max_size);
+  int min_numel = getBlockNumel(min_level);
+  int max_numel = getBlockNumel(max_level);
+  return BlockProfile{min_size, max_size, min_level, max_level, min_numel, max_numel, max_numel / min_numel};
+}
+
+// "large" has fewer base leafs on high resolution photos, "fast" does less match and propagation work
+constexpr BlockProfile kBlockProfiles[] = {makeBlockProfile({2, 2}, {32, 32}), makeBlockProfile({2, 2}, {64, 64}),
+                                           makeBlockProfile({4, 4}, {32, 32})};
+constexpr const char* kBlockProfileNames[] = {"default", "large", "fast"};
+constexpr int kNumBlockProfiles = std::size(kBlockProfiles);
+constexpr int kDefaultBlockProfile = 0;
+
+constexpr bool validateBlockProfiles() {
+  for (const auto& profile : kBlockProfiles) {
+    if (!validateBlockSize(profile.min_size_) || !validateBlockSize(profile.max_size_) ||
+        profile.min_level_ >= profile.max_level_ || profile.max_size_.first / kMaxScale < 2) {
+      return false;
+    }
+  }
+  return kNumBlockProfiles <= (1 << kBitsForBlockProfile);
+}
+static_assert(validateBlockProfiles());
 
-constexpr int kNumBlockLevels = kMaxBlockLevel - kMinBlockLevel + 1;
+// levels of blocks of any profile, level indexed tables cover them
+constexpr int minSupportedLevel() {
+  int level = kBlockProfiles[0].min_level_;
+  for (const auto& profile : kBlockProfiles) {
+    level = profile.min_level_ < level ? profile.min_level_ : level;
+  }
+  return level;
+}
 
-constexpr int kMinBlockNumel = getBlockNumel(kMinBlockLevel);
-constexpr int kMaxBlockNumel = getBlockNumel(kMaxBlockLevel);
+constexpr int maxSupportedLevel() {
+  int level = kBlockProfiles[0].max_level_;
+  for (const auto& profile : kBlockProfiles) {
+    level = profile.max_level_ > level ? profile.max_level_ : level;
+  }
+  return level;
+}
 
-constexpr int kMinBlocksInMax = kMaxBlockNumel / kMinBlockNumel;
+constexpr int kMinSupportedLevel = minSupportedLevel();
+constexpr int kMaxSupportedLevel = maxSupportedLevel();
+constexpr int kNumSupportedLevels = kMaxSupportedLevel - kMinSupportedLevel + 1;
+constexpr Size kMaxSupportedBlockSize = getBlockSize(kMaxSupportedLevel);
 
 constexpr int kVecBytes = kVecNumel * sizeof(float);
 
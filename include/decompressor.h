@@ -1,47 +1,220 @@
 #pragma once
 
-#include <chrono>
+#include <algorithm>
 #include <vector>
 
 #include "common.h"
 #include "image.h"
 #include "io.h"
+#include "telemetry.h"
 #include "utils.h"
 
-// decompresses one channel
-class Decompressor {
+class Dictionary;
+
+// stopping rule of iterative restore
+struct RestoreParams {
+  int max_applies = kNumApplies;
+  // restore stops once maximum or mean absolute pixel change of an iteration falls below these, 0 disables a check
+  float max_delta = kConvergenceMaxDelta;
+  float mean_delta = 0;
+  // caps iterations by the number recommended in the stream header instead of max_applies
+  bool use_recommended_applies = false;
+  // Gauss-Seidel style iterations: the helper channel is updated as each translation is applied, so later
+  // translations of the same sweep already see new values
+  bool in_place = false;
+  // threads splitting every iteration by rows of maximum blocks, ignored by in place iterations
+  int num_threads = 1;
+  // decodes channels concurrently, each of them with num_threads threads
+  bool parallel_channels = true;
+  // takes source block means from summed area table of the helper instead of summing blocks up, ignored by in place
+  // iterations
+  bool sat_means = false;
+  // iterations write the quarter size helper straight from its previous state, full size channel is written only by the
+  // last apply. Ignored by in place iterations and summed area table means
+  bool fused = true;
+  // decodes at 1 / scale of the coded resolution, a power of two up to kMaxScale
+  int scale = 1;
+  // decodes only the rectangle of given size with top left corner at roi_offset, in coordinates of the scaled canvas.
+  // Empty size decodes the whole canvas
+  Offset roi_offset{0, 0};
+  Size roi_size{0, 0};
+  // dictionary streams were coded with, required by them and ignored by the others. They decode at full scale
+  const Dictionary* dictionary = nullptr;
+};
+
+// translations of one level in structure of arrays layout
+struct TranslationBucket {
+  std::vector<int> a_mem_offsets_;
+  std::vector<int> b_mem_offsets_;
+  std::vector<int> b_sat_offsets_;
+  // destination in the quarter size helper and wrapped source position in it, for fused iterations
+  std::vector<int> a_helper_offsets_;
+  std::vector<int> b_rows_;
+  std::vector<int> b_cols_;
+  std::vector<float> brightness_;
+};
+
+// downsampled channel translations read from, together with summed area table of its values, so that a block mean
+// costs four lookups whatever the block size
+class HelperImage {
 public:
-  Decompressor(const Metadata& metadata);
+  HelperImage(Size sz, bool with_sat = true);
 
-  Channel decompress(RStream& stream);
+  // downsamples given rows of the channel and sums up rows of the table they cover
+  void downsampleRows(const Channel& chl, int begin_row, int end_row);
+  // completes the table for given columns, all rows should be summed up first
+  void accumulateColumns(int begin_col, int end_col);
 
-  // applies translations once
-  void apply(Channel& dst, const Channel& src) const;
-  void reportTimings() const;
+  // translations' sources never leave the top left quarter by more than a maximum block, so the table covers only it
+  static Size satSize(Size sz);
+  static int satOffset(Size sz, int mem_offset);
+
+  Channel& channel() { return chl_; }
+  const Channel& channel() const { return chl_; }
+
+  // nullptr if the table is not built
+  const double* sat() const { return sat_.empty() ? nullptr : sat_.data(); }
+  int satStride() const { return sat_sz_.second; }
+  int numSatColumns() const { return sat_sz_.second; }
 
 private:
+  Channel chl_;
+  Size sat_sz_;
+  std::vector<double> sat_;
+};
+
+// decompresses one channel
+class Decompressor {
+public:
+  // change of the destination channel made by one apply
+  struct Delta {
+    float max_ = 0;
+    double sum_ = 0;
+
+    void add(const Delta& other) {
+      max_ = std::max(max_, other.max_);
+      sum_ += other.sum_;
+    }
+  };
+
   // stores location of each leaf subblock of reference channel, location and brigntess offset of its match
   struct Translation {
     int a_mem_offset_;
     int b_mem_offset_;
     int brightness_;
+    int level_;
     Size sz_;
   };
 
-  // loads one max block
-  void deserializeNodes(RStream& stream);
+  // channels of sequence frames pass translations every maximum block of the previous frame was decoded into, blocks
+  // of inter frames repeat them. Deserialization overwrites them with the blocks of this frame. domain is the
+  // dictionary helper translations read from instead of the channel's own one, restore is then a single apply
+  Decompressor(const Metadata& metadata, bool entropy_coded = false, bool inter = false,
+               std::vector<std::vector<Translation>>* history = nullptr, const HelperImage* domain = nullptr);
 
-  // loads all blocks
-  void deserializeNode(RStream&, int level, int block_num, int subblock_num);
+  // chunk_offsets are byte offsets of the channel's chunks of rows_per_chunk rows of maximum blocks in the stream
+  Channel decompress(const RStream& stream, const std::vector<int>& chunk_offsets, int rows_per_chunk,
+                     const RestoreParams& params = {});
+  // progressive layout written by Compressor::serializeBase and serializeRefinements, channels' calls interleaved the
+  // same way. Both return false at the first record cut by the end of the stream, blocks loaded by then stay leafs
+  bool deserializeBase(RStream& stream);
+  bool deserializeRefinements(int level, RStream& stream);
+  // restores translations loaded by the calls above
+  Channel decompress(const RestoreParams& params = {});
 
-  // iteratively applies translations given number of times
-  Channel restore(int number_applies = kNumApplies) const;
+  // applies translations once
+  Delta apply(Channel& dst, const HelperImage& src) const;
+  // applies translations writing given row of maximum blocks
+  Delta applyBand(int band, Channel& dst, const HelperImage& src) const;
+  // same, reading sources from the quarter size helper with wrapping instead of its tiled copies
+  Delta applyBand(int band, Channel& dst, const Channel& helper) const;
+  // applies translations writing given row of maximum blocks and downsamples the result straight into next_helper,
+  // the delta is of next_helper
+  Delta fuseBand(int band, Channel& next_helper, const Channel& helper) const;
+  // applies translations once in dependency friendly order updating the helper channel after each of them
+  Delta applyInPlace(Channel& dst, Channel& helper) const;
+  const Telemetry& telemetry() const { return telemetry_; }
+  void reportTimings() const;
+
+  // number of iterations the last restore took
+  int numApplies() const { return num_applies_; }
+
+private:
+  // loads all maximum blocks, chunks of them are split between threads
+  void deserializeNodes(const RStream& stream, const std::vector<int>& chunk_offsets, int rows_per_chunk,
+                        int num_threads);
+
+  // loads one block with RawTreeReader or EntropyTreeReader, returns the split flag
+  template <typename Reader>
+  bool deserializeNode(Reader& reader, std::vector<Translation>& translations, int level, int block_num,
+                       int subblock_num, int sibling);
+  template <typename Reader>
+  Translation deserializeLeaf(Reader& reader, int level, int block_num, int subblock_num);
+
+  // leaf of the level being refined by progressive deserialization
+  struct FrontierNode {
+    int block_num_;
+    int subblock_num_;
+    Translation translation_;
+  };
+
+  // groups translations by row of maximum blocks they write and by level for block size specialised kernels
+  void buildBuckets();
+
+  // maps translations onto the canvas reduced by scale. Leafs thinner than two pixels there become constant pixels with
+  // area averaged brightness: a translated block keeps its brightness as its mean, so that is all the canvas can show
+  void scaleTranslations(int scale);
+
+  // fills constant pixels of the result
+  void fillConstants(Channel& result) const;
+
+  // translation writing each pixel of the quarter size helper, -1 for pixels of constant canvas pixels
+  std::vector<int> helperWriters() const;
+  // translations writing helper pixels the given translation reads
+  std::vector<int> producers(const std::vector<int>& writers, int tr_num) const;
+  // keeps only translations the rectangle depends on: the ones writing it and, transitively, their producers
+  void restrictToRegion(Offset ofs, Size sz);
+
+  // orders translations for in place iterations
+  void buildInPlaceOrder();
+
+  // iteratively applies translations until convergence or the iterations cap
+  Channel restore(const RestoreParams& params) const;
+  void restoreInPlace(const RestoreParams& params, Channel& result) const;
+  void restoreTiled(const RestoreParams& params, Channel& result) const;
+  void restoreFused(const RestoreParams& params, Channel& result) const;
 
   const Metadata& metadata_;
+  bool entropy_coded_;
+  bool inter_;
+  std::vector<std::vector<Translation>>* history_;
+  const HelperImage* domain_;
   Storage<Size> subblock_sizes_;
 
+  // canvas size and height of its rows of maximum blocks, both reduced by the decoding scale
+  Size sz_;
+  int band_height_;
+
   std::vector<Translation> translations_;
+  std::vector<FrontierNode> frontier_;
+  std::vector<Storage<TranslationBucket>> band_buckets_;
+  std::vector<int> in_place_order_;
+  // canvas offsets and values of pixels covered by leafs too small for the canvas
+  std::vector<std::pair<int, float>> constants_;
 
-  mutable std::chrono::duration<double> deserialization_time_{0};
-  mutable std::chrono::duration<double> restore_time_{0};
+  mutable int num_applies_ = 0;
+  mutable Telemetry telemetry_;
 };
+
+// translations of every maximum block of a channel
+using BlockTranslations = std::vector<std::vector<Decompressor::Translation>>;
+
+// what decoding a frame of a sequence leaves for the next frame
+struct FrameHistory {
+  std::vector<std::pair<int, int>> ranges_;
+  std::vector<BlockTranslations> channels_;
+};
+
+// number of iterations needed to restore every channel of the stream. Frames of a sequence pass the history of the
+// previous frame, which decoding replaces with their own
+int recommendNumApplies(std::vector<char> data, FrameHistory* history = nullptr);
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "decompressor.h"
+#include "image.h"
+
+// shared domain pool for collections of similar images: translations of images coded with a dictionary read from the
+// dictionary image's helpers instead of their own. Sources are then known before decoding, so restore is a single
+// apply. The dictionary is prepared once, every image coded or decoded with it reuses the same helpers. Images should
+// have its shape
+class Dictionary {
+public:
+  explicit Dictionary(const Image& img);
+
+  Size size() const { return sz_; }
+  int numChannels() const { return helpers_.size(); }
+  // hash of the dictionary pixels, streams record it so that they are not decoded with another dictionary
+  uint32_t id() const { return id_; }
+  // helper of the channel of given size, downsampled the way the channel's own helper would be and normalized by the
+  // dictionary's ranges. Half size chroma gets the subsampled dictionary chroma, nullptr for sizes it does not have
+  const HelperImage* helper(int channel_num, Size sz) const;
+
+private:
+  Size sz_;
+  uint32_t id_;
+  std::vector<HelperImage> helpers_;
+  std::vector<HelperImage> chroma_helpers_;
+};
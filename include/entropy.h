@@ -0,0 +1,201 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "utils.h"
+
+// adaptive binary range coder: every bit is coded with a probability model that follows the statistics of bits
+// already coded in the same context
+constexpr int kProbBits = 11;
+constexpr int kProbAdaptShift = 5;
+constexpr uint32_t kRangeTop = 1u << 24;
+
+// probability of zero bit scaled by 1 << kProbBits
+struct BitModel {
+  uint16_t prob_ = 1u << (kProbBits - 1);
+};
+
+class RangeEncoder {
+public:
+  void encode(BitModel& model, int bit) {
+    uint32_t bound = (range_ >> kProbBits) * model.prob_;
+    if (!bit) {
+      range_ = bound;
+      model.prob_ += ((1u << kProbBits) - model.prob_) >> kProbAdaptShift;
+    } else {
+      low_ += bound;
+      range_ -= bound;
+      model.prob_ -= model.prob_ >> kProbAdaptShift;
+    }
+    normalize();
+  }
+
+  // equiprobable bits, most significant first
+  void encodeDirect(uint32_t x, int bits) {
+    while (bits--) {
+      range_ >>= 1;
+      low_ += range_ & (0 - ((x >> bits) & 1));
+      normalize();
+    }
+  }
+
+  // flushes the state, the coder can not be used after that. Only the top bytes of a value inside the final interval
+  // are emitted, the decoder reads whatever follows as the rest of it. The first byte is always zero and is dropped
+  std::vector<unsigned char> finish() {
+    int num_bytes = 4;
+    for (int n = 1; n < 4; ++n) {
+      uint64_t mask = (uint64_t{1} << (32 - 8 * n)) - 1;
+      uint64_t value = (low_ + mask) & ~mask;
+      if (value + mask <= low_ + range_ - 1) {
+        low_ = value;
+        num_bytes = n;
+        break;
+      }
+    }
+    for (int i = 0; i <= num_bytes; ++i) {
+      shiftLow();
+    }
+    bytes_.erase(bytes_.begin());
+    return std::move(bytes_);
+  }
+
+private:
+  void normalize() {
+    while (range_ < kRangeTop) {
+      range_ <<= 8;
+      shiftLow();
+    }
+  }
+
+  // emits the top byte of low once no carry can change it
+  void shiftLow() {
+    if (static_cast<uint32_t>(low_) < 0xFF000000u || (low_ >> 32) != 0) {
+      unsigned char carry = low_ >> 32;
+      unsigned char byte = cache_;
+      do {
+        bytes_.push_back(byte + carry);
+        byte = 0xFF;
+      } while (--cache_size_ != 0);
+      cache_ = (low_ >> 24) & 0xFF;
+    }
+    ++cache_size_;
+    low_ = (low_ & 0x00FFFFFFu) << 8;
+  }
+
+  uint64_t low_ = 0;
+  uint32_t range_ = 0xFFFFFFFFu;
+  unsigned char cache_ = 0;
+  uint64_t cache_size_ = 1;
+  std::vector<unsigned char> bytes_;
+};
+
+class RangeDecoder {
+public:
+  // bytes past end are read as zeros
+  RangeDecoder(const char* data, const char* end)
+      : data_{reinterpret_cast<const unsigned char*>(data)}, end_{reinterpret_cast<const unsigned char*>(end)} {
+    for (int i = 0; i < 4; ++i) {
+      code_ = (code_ << 8) | nextByte();
+    }
+  }
+
+  int decode(BitModel& model) {
+    uint32_t bound = (range_ >> kProbBits) * model.prob_;
+    int bit;
+    if (code_ < bound) {
+      range_ = bound;
+      model.prob_ += ((1u << kProbBits) - model.prob_) >> kProbAdaptShift;
+      bit = 0;
+    } else {
+      code_ -= bound;
+      range_ -= bound;
+      model.prob_ -= model.prob_ >> kProbAdaptShift;
+      bit = 1;
+    }
+    normalize();
+    return bit;
+  }
+
+  uint32_t decodeDirect(int bits) {
+    uint32_t x = 0;
+    while (bits--) {
+      range_ >>= 1;
+      uint32_t bit = code_ >= range_;
+      code_ -= range_ & (0 - bit);
+      x = (x << 1) | bit;
+      normalize();
+    }
+    return x;
+  }
+
+private:
+  void normalize() {
+    while (range_ < kRangeTop) {
+      range_ <<= 8;
+      code_ = (code_ << 8) | nextByte();
+    }
+  }
+
+  unsigned char nextByte() { return data_ < end_ ? *data_++ : 0; }
+
+  const unsigned char* data_;
+  const unsigned char* end_;
+  uint32_t code_ = 0;
+  uint32_t range_ = 0xFFFFFFFFu;
+};
+
+// context models of tree fields. Split flags are modelled per level and left sibling's flag. Brightness is coded as
+// difference from its prediction by left, top and top left leafs: zero flag, sign, bit length in unary and remaining
+// bits. Top bits of match index are coded by a binary tree of models per level, the lower ones are close to uniform
+constexpr int kMatchTreeBits = 6;
+
+struct LeafContexts {
+  // split flag contexts: first child, right child of unsplit left sibling, right child of split left sibling
+  Storage<std::array<BitModel, 3>> split_;
+  BitModel same_;
+  BitModel zero_;
+  BitModel sign_;
+  BitModel length_[kBitDepth];
+  BitModel mantissa_[kBitDepth + 1][kBitDepth];
+  Storage<std::array<BitModel, 1 << kMatchTreeBits>> match_tree_;
+};
+
+// codes tree fields of one channel, the encoder and the decoder adapt the same contexts in the same order. Leafs are
+// coded in tree order, so leafs to the left and above of a leaf are always known before it
+class LeafCoder {
+public:
+  // sz is the channel size, min_block_size the size of the smallest leafs of its block profile
+  LeafCoder(Size sz, Size min_block_size, int bits_for_match_idx);
+
+  // sibling is 0 for first children, 1 + left sibling's split flag for second ones
+  void encodeSplit(RangeEncoder& enc, int level, int sibling, bool split) {
+    enc.encode(ctx_.split_[level][sibling], split);
+  }
+  bool decodeSplit(RangeDecoder& dec, int level, int sibling) { return dec.decode(ctx_.split_[level][sibling]); }
+
+  // flag of maximum blocks of inter frames repeating the previous frame's leafs
+  void encodeSame(RangeEncoder& enc, bool same) { enc.encode(ctx_.same_, same); }
+  bool decodeSame(RangeDecoder& dec) { return dec.decode(ctx_.same_); }
+
+  // mem_offset is the leaf position in the channel
+  void encodeLeaf(RangeEncoder& enc, int level, int mem_offset, int brightness, int match);
+  void decodeLeaf(RangeDecoder& dec, int level, int mem_offset, int& brightness, int& match);
+
+private:
+  // median edge detector of LOCO-I over brightness of neighbouring leafs
+  int predictBrightness(int cell) const;
+  // records brightness in the right column and the bottom row of the leaf's cells, the only ones later leafs look at
+  void storeBrightness(int level, int cell, int brightness);
+  int cellOf(int mem_offset) const;
+
+  int bits_for_match_idx_;
+  int width_;
+  Size min_block_size_;
+  LeafContexts ctx_;
+  // brightness of known leafs by minimum blocks, -1 for unknown
+  std::vector<int> cells_;
+  int cells_width_;
+  int prev_brightness_ = kBitRange / 2;
+};
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "utils.h"
+
+// interleaved 8 bit pixels together with the way to free them, a no-op for borrowed buffers
+using PixelBuffer = std::unique_ptr<unsigned char[], std::function<void(unsigned char*)>>;
+
+PixelBuffer allocPixels(int n);
+
+struct Pixels {
+  Size sz_{0, 0};
+  int channels_ = 0;
+  PixelBuffer data_;
+};
+
+// picks the file format by extension: .pgm, .ppm and .pnm are binary netpbm, .y4m is YUV4MPEG2 video, .gray and .rgb
+// are headerless pixels named <name>.<width>x<height>.<ext>. Anything else is read by stb and written as png. Netpbm and
+// raw pixels are read straight into the returned buffer. Failed reads return no pixels
+Pixels readPixels(const std::string& path);
+// y4m is written as a single frame, 4:4:4 for rgb and mono for grayscale pixels
+void writePixels(const std::string& path, const unsigned char* data, Size sz, int channels);
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "io.h"
+#include "utils.h"
+
+// container layout: magic, version, the header fields below, chunk index, then chunks. Every channel is split into
+// chunks by rows_per_chunk_ rows of maximum blocks, each starting at a byte boundary and decodable on its own.
+// Progressive streams have no index, a single body of all channels follows the header instead, see
+// Compressor::serializeBase
+constexpr char kFormatMagic[] = {'F', 'C', 'M', 'P'};
+constexpr int kFormatVersion = 6;
+constexpr int kBitsForFormatVersion = 8;
+constexpr int kBitsForChunkSizeWidth = 5;
+
+// global stream parameters preceding channels' data
+struct StreamHeader {
+  Size sz_;
+  int num_channels_;
+  bool subsample_chroma_;
+  // channels' trees are range coded with adaptive contexts instead of written raw
+  bool entropy_coded_;
+  // channels are interleaved coarse levels first, so any prefix of the stream decodes
+  bool progressive_;
+  // frame of a sequence coded against the previous one, every maximum block is preceded by a flag repeating its leafs
+  // from the previous frame
+  bool inter_;
+  // translations read from a shared dictionary instead of the image's own helper, see Dictionary. Its id is written
+  // only for such streams
+  bool dictionary_;
+  uint32_t dictionary_id_;
+  // index of kBlockProfiles, the range of leaf sizes channels are split into
+  int block_profile_;
+  // number of restore iterations the encoder measured to converge, so fixed latency decoders know the cost up front
+  int num_applies_;
+  std::vector<std::pair<int, int>> ranges_;
+  // rows of maximum blocks in every chunk, the last one of a channel may have fewer. Written only for entropy coded
+  // streams, raw ones have a chunk per row
+  int rows_per_chunk_ = 1;
+  // byte sizes of chunks of every channel, the index written in the header
+  std::vector<std::vector<int>> chunk_sizes_;
+  // byte offsets of chunks from the stream start, filled by read
+  std::vector<std::vector<int>> chunk_offsets_;
+
+  // writes the header with the index of given chunks, then the chunks. Progressive streams take no chunks, the body
+  // is written after the header
+  void write(WStream& stream, const std::vector<std::vector<std::vector<char>>>& chunks);
+  // reads the header and the index leaving the stream at the first chunk or the progressive body, nullopt for streams
+  // of other formats or versions
+  static std::optional<StreamHeader> read(RStream& stream);
+
+  // overwrites the recommended number of applies in already written stream
+  static void patchNumApplies(WStream& stream, int num_applies);
+
+  // bits taken by the header without the index
+  int numFieldBits() const;
+  Size channelSize(int channel_num) const;
+  // number of chunks of the channel, 0 for progressive streams
+  int numChunks(int channel_num) const;
+};
@@ -5,11 +5,13 @@
 #include <utility>
 #include <vector>
 
+#include "formats.h"
 #include "utils.h"
 
 class Channel {
 public:
-  Channel(Size sz, bool fill = false) : h_{sz.first}, w_{sz.second}, buf_{std::make_unique<float[]>(h_ * w_)} {
+  Channel(Size sz, bool fill = false)
+      : h_{sz.first}, w_{sz.second}, buf_{std::make_unique_for_overwrite<float[]>(h_ * w_)} {
     if (fill) {
       std::memset(buf_.get(), 0, h_ * w_ * sizeof(float));
     }
@@ -17,10 +19,29 @@ public:
 
   Channel(const Channel& other) = delete;
   Channel(Channel&& other) noexcept : h_{other.h_}, w_{other.w_}, buf_{std::move(other.buf_)} { }
+  Channel& operator=(Channel&& other) noexcept {
+    h_ = other.h_;
+    w_ = other.w_;
+    buf_ = std::move(other.buf_);
+    return *this;
+  }
 
   void downsampleTo(Channel& to, float alpha = kAlpha) const;
+  // downsamples only given rows of this channel, writing corresponding rows of the four tiled copies
+  void downsampleRowsTo(Channel& to, int begin_row, int end_row, float alpha = kAlpha) const;
+  // 2x2 box-filtered half resolution copy
+  Channel subsample() const;
+  // bilinear double resolution copy, inverse of subsample
+  Channel upsample() const;
+  // copy of the rectangle of given size with top left corner at ofs
+  Channel crop(Offset ofs, Size sz) const;
+  // maps values onto [0, kBitRange] returning the integer range they are mapped from
   std::pair<int, int> normalize();
+  // maps given range onto [0, kBitRange]
+  void normalize(std::pair<int, int> range);
   std::pair<float, float> getStats() const;
+  // range normalize maps from for values of given minimum and maximum
+  static std::pair<int, int> rangeOf(std::pair<float, float> stats);
   void denormalize(std::pair<int, int> range);
   void save(const std::string& path) const;
 
@@ -46,8 +67,12 @@ private:
 
 class Image {
 public:
+  // the format is picked by extension, see readPixels
   Image(const std::string& path);
-  Image(const std::vector<Channel>& channels);
+  // denormalizes channels by ranges if given, converts yuv to rgb and interleaves pixels in one pass
+  Image(const std::vector<Channel>& channels, const std::vector<std::pair<int, int>>& ranges = {});
+  // borrows caller owned interleaved pixels, which should outlive the image
+  Image(unsigned char* data, Size sz, int channels);
   Image(Image&& other) noexcept : sz_{other.sz_}, channels_{other.channels_}, data_{std::move(other.data_)} { }
 
   auto numel() const { return sz_.first * sz_.second; }
@@ -56,11 +81,18 @@ public:
   auto* mem() { return data_.get(); }
   const auto* mem() const { return data_.get(); }
 
-  void save(const std::string& path);
+  // the format is picked by extension, see writePixels
+  void save(const std::string& path) const;
+  // gray or yuv channels, converted in one vectorized pass
   std::vector<Channel> extractChannels() const;
+  // minimum and maximum of every channel extractChannels gives, in a read only pass
+  std::vector<std::pair<float, float>> channelsStats() const;
+  // same as extractChannels with channels normalized by given ranges, see Channel::normalize
+  std::vector<Channel> extractNormalizedChannels(const std::vector<std::pair<int, int>>& ranges) const;
+  int numChannels() const { return channels_; }
 
 private:
   Size sz_;
   int channels_;
-  std::unique_ptr<unsigned char[]> data_;
+  PixelBuffer data_;
 };
@@ -1,8 +1,63 @@
 #pragma once
 
+#include <cstddef>
+#include <span>
 #include <string>
+#include <utility>
+#include <vector>
 
+#include "compressor.h"
+#include "decompressor.h"
+#include "dictionary.h"
 #include "image.h"
 
-void compressImage(const Image& img, const std::string& filepath, int target_size_bytes, bool report_timings = false);
-Image decompressImage(const std::string& filepath, bool report_timings = false);
+// subsample_chroma codes U and V planes of rgb images at half resolution in each dimension (4:2:0), entropy_coded
+// range codes trees of leafs with adaptive contexts and fits as many leafs as the coded size allows. progressive
+// orders the stream coarse levels first, so that any prefix of it decodes to a coarser image. Images coded with a
+// dictionary of their shape match against it instead of themselves and decode with RestoreParams::dictionary in a
+// single apply. block_profile indexes kBlockProfiles, the range of leaf sizes the image is split into
+void compressImage(const Image& img, const std::string& filepath, int target_size_bytes, bool report_timings = false,
+                   bool subsample_chroma = false, bool entropy_coded = false, bool progressive = false,
+                   const Dictionary* dictionary = nullptr, int block_profile = kDefaultBlockProfile);
+// the file is memory mapped, spans are read in place and should stay alive during the call
+Image decompressImage(const std::string& filepath, bool report_timings = false, const RestoreParams& params = {});
+Image decompressImage(std::span<const std::byte> data, bool report_timings = false, const RestoreParams& params = {});
+// prints the stream header and its chunk index, returns false for streams of other formats
+bool printStreamInfo(const std::string& filepath);
+
+// what the encoder of a sequence keeps from the previous frame: its channels' leafs and the translations the decoder
+// restored them into
+struct SequenceState {
+  Size sz_{0, 0};
+  std::vector<std::pair<int, int>> ranges_;
+  std::vector<ChannelHistory> channels_;
+  FrameHistory decoded_;
+  // maximum blocks of the last frame repeating the previous one, across channels
+  int num_same_blocks_ = 0;
+};
+
+// codes frames of a sequence one after another. Maximum blocks whose previous leafs still fit them repeat those for a
+// flag, the others search matches around the previous ones first and the whole helper only if their error regresses.
+// A frame of another shape or after a scene cut is coded on its own and starts over
+class SequenceEncoder {
+public:
+  SequenceEncoder(bool subsample_chroma = false, bool entropy_coded = false, int block_profile = kDefaultBlockProfile);
+
+  void compressFrame(const Image& img, const std::string& filepath, int target_size_bytes, bool report_timings = false);
+  int numSameBlocks() const { return state_.num_same_blocks_; }
+
+private:
+  bool subsample_chroma_;
+  bool entropy_coded_;
+  int block_profile_;
+  SequenceState state_;
+};
+
+// decodes frames of a sequence in coding order, inter frames repeat blocks of the frame decoded before them
+class SequenceDecoder {
+public:
+  Image decompressFrame(const std::string& filepath, bool report_timings = false, const RestoreParams& params = {});
+
+private:
+  FrameHistory history_;
+};
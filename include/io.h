@@ -1,72 +1,163 @@
 #pragma once
 
 #include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <span>
 #include <string>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// bits are stored most significant first. Both streams move up to kMaxBitsPerCall bits per call through a 64 bit word
+constexpr int kMaxBitsPerCall = 57;
+constexpr int kWordBytes = sizeof(uint64_t);
+
 class WStream {
 public:
-  WStream() : bits_left_{CHAR_BIT}, cur_{0}, data_{} { }
+  WStream() : acc_{0}, num_pending_{0}, size_{0}, data_(kInitialCapacity) { }
 
-  void save(const std::string& path) {
-    if (bits_left_ < CHAR_BIT) {
-      data_.push_back(cur_);
-    }
+  void save(const std::string& path) const {
+    auto data = bytes();
     std::ofstream ofs{path, std::ofstream::binary};
-    ofs.write(data_.data(), data_.size());
+    ofs.write(data.data(), data.size());
   }
 
-  void dump(unsigned x, int bits) {
-    unsigned x_mask = 1u << (bits - 1);
-    while (x_mask) {
-      unsigned extracted_bit = (x & x_mask) > 0;
-      cur_ += extracted_bit << (bits_left_ - 1);
-      x_mask >>= 1;
-      --bits_left_;
-      if (bits_left_ == 0) {
-        bits_left_ = CHAR_BIT;
-        data_.push_back(cur_);
-        cur_ = 0;
+  // written data including the last partial byte
+  std::vector<char> bytes() const {
+    std::vector<char> data{data_.begin(), data_.begin() + size_};
+    if (num_pending_ > 0) {
+      data.push_back(static_cast<char>(acc_ << (CHAR_BIT - num_pending_)));
+    }
+    return data;
+  }
+
+  int numBits() const { return size_ * CHAR_BIT + num_pending_; }
+
+  // overwrites already dumped bits starting at bit_pos
+  void patch(int bit_pos, unsigned x, int bits) {
+    for (int i = 0; i < bits; ++i, ++bit_pos) {
+      uint64_t bit = (x >> (bits - 1 - i)) & 1;
+      int byte_num = bit_pos / CHAR_BIT;
+      if (byte_num < size_) {
+        auto* byte = reinterpret_cast<unsigned char*>(&data_[byte_num]);
+        unsigned mask = 1u << (CHAR_BIT - 1 - bit_pos % CHAR_BIT);
+        *byte = bit ? (*byte | mask) : (*byte & ~mask);
+      } else {
+        int shift = num_pending_ - 1 - (bit_pos - size_ * CHAR_BIT);
+        acc_ = (acc_ & ~(uint64_t{1} << shift)) | (bit << shift);
       }
     }
   }
 
+  // pads the last byte with zero bits
+  void align() { dump(0, (CHAR_BIT - num_pending_) % CHAR_BIT); }
+
+  // appends lower bits of x, bits should not exceed kMaxBitsPerCall
+  void dump(uint64_t x, int bits) {
+    if (bits == 0) [[unlikely]] {
+      return;
+    }
+    // fewer than CHAR_BIT bits are pending between calls, so they all fit the word together with new ones. Bits above
+    // the pending ones are garbage shifted out on flush
+    acc_ = (acc_ << bits) | (x & ((uint64_t{1} << bits) - 1));
+    num_pending_ += bits;
+    if (size_ + kWordBytes > data_.size()) [[unlikely]] {
+      data_.resize(data_.size() * 2);
+    }
+    // whole pending bytes are stored at once, the rest of the word is overwritten by the next flush
+    uint64_t word = __builtin_bswap64(acc_ << (sizeof(uint64_t) * CHAR_BIT - num_pending_));
+    std::memcpy(data_.data() + size_, &word, kWordBytes);
+    size_ += num_pending_ / CHAR_BIT;
+    num_pending_ %= CHAR_BIT;
+  }
+
 private:
-  unsigned bits_left_;
-  unsigned char cur_;
+  static constexpr int kInitialCapacity = 1 << 12;
+
+  uint64_t acc_;
+  int num_pending_;
+  int size_;
   std::vector<char> data_;
 };
 
+// reads bits from a memory mapped file, an owned vector or a caller owned span without copying them. Reads near the end
+// of the data see zero bits past it
 class RStream {
 public:
-  RStream(const std::string& path) : bits_left_{CHAR_BIT}, cur_byte_{0}, data_{0} {
-    std::ifstream ifs{path, std::ifstream::binary};
-    ifs.seekg(0, std::ios::end);
-    std::streamsize size = ifs.tellg();
-    ifs.seekg(0, std::ios::beg);
-    data_.resize(size);
-    ifs.read(data_.data(), size);
+  // maps the file for reading, an unreadable file gives an empty stream
+  RStream(const std::string& path) : pos_{0}, data_{nullptr}, size_{0} {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) == 0 && st.st_size > 0) {
+      void* map = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map != MAP_FAILED) {
+        size_t size = st.st_size;
+        ::madvise(map, size, MADV_SEQUENTIAL);
+        owner_ = std::shared_ptr<const void>{map, [size](const void* p) { ::munmap(const_cast<void*>(p), size); }};
+        data_ = static_cast<const char*>(map);
+        size_ = size;
+      }
+    }
+    ::close(fd);
   }
 
-  unsigned extract(int bits) {
-    int extracted = 0;
-    while (bits) {
-      unsigned extracted_bit = (data_[cur_byte_] & (1 << (bits_left_ - 1))) > 0;
-      extracted += extracted_bit << (bits - 1);
-      --bits_left_;
-      if (bits_left_ == 0) {
-        bits_left_ = CHAR_BIT;
-        ++cur_byte_;
-      }
-      --bits;
+  RStream(std::vector<char> data) : pos_{0} {
+    auto owned = std::make_shared<const std::vector<char>>(std::move(data));
+    data_ = owned->data();
+    size_ = owned->size();
+    owner_ = std::move(owned);
+  }
+
+  // the caller keeps data alive while the stream and its copies are used
+  RStream(std::span<const std::byte> data)
+      : pos_{0}, data_{reinterpret_cast<const char*>(data.data())}, size_{data.size()} { }
+
+  // copies share the data but read it independently
+  RStream(const RStream& other) = default;
+
+  // moves reading position to given bit
+  void seek(int bit_pos) { pos_ = bit_pos; }
+
+  int bitPos() const { return pos_; }
+  int numBits() const { return size_ * CHAR_BIT; }
+
+  // skips to the next byte boundary like WStream::align
+  void align() { pos_ = (pos_ + CHAR_BIT - 1) / CHAR_BIT * CHAR_BIT; }
+
+  // data from the reading position on, which should be byte aligned, up to end()
+  const char* mem() const { return data_ + pos_ / CHAR_BIT; }
+  const char* end() const { return data_ + size_; }
+
+  // reads next bits, bits should not exceed kMaxBitsPerCall
+  uint64_t extract(int bits) {
+    uint64_t word = 0;
+    size_t byte_num = pos_ / CHAR_BIT;
+    if (byte_num + kWordBytes <= size_) [[likely]] {
+      std::memcpy(&word, data_ + byte_num, kWordBytes);
+    } else if (byte_num < size_) {
+      std::memcpy(&word, data_ + byte_num, size_ - byte_num);
     }
-    return extracted;
+    word = __builtin_bswap64(word) << (pos_ % CHAR_BIT);
+    pos_ += bits;
+    // two shifts keep zero bits request defined
+    return (word >> 1) >> (sizeof(uint64_t) * CHAR_BIT - 1 - bits);
   }
 
 private:
-  int bits_left_;
-  int cur_byte_;
-  std::vector<char> data_;
+  int pos_;
+  // keeps the mapping or the vector alive, empty for borrowed spans
+  std::shared_ptr<const void> owner_;
+  const char* data_;
+  size_t size_;
 };
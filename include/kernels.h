@@ -0,0 +1,50 @@
+#pragma once
+
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+#include "utils.h"
+
+// hot loops of the compressor, exposed for fcomp_bench. Groups are kVecNumel maximum blocks in vector lanes. Kernels
+// sized by block profile are instantiated for every profile of kBlockProfiles
+
+// transforms blocks of the channel at mem_offsets into a group: pixels of every minimum block with its mean
+// subtracted, means of blocks of every level and sums of squares of minimum blocks
+template <int kProfile>
+void reorder(Vec* __restrict__ group, const float* __restrict__ mem, Vec* __restrict__ mean, Vec* __restrict__ sumsq,
+             const Pattern& pattern, const IVec& mem_offsets);
+// errors of minimum blocks of an "a" group against every block of a "b" group
+template <int kProfile>
+void matchGroup(const Vec* __restrict__ a_group, const Vec* __restrict__ b_group, Vec* __restrict__ asumsq,
+                Vec* __restrict__ bsumsq, Vec* __restrict__ buf);
+// combines minimum blocks' errors into errors of blocks of every level and keeps the best matches
+template <int kProfile>
+void reduce(Vec* __restrict__ buf, Vec* __restrict__ errors, IVec* __restrict__ matches, const IVec update_matches,
+            const Vec* __restrict__ a_mean, const Vec* __restrict__ b_mean);
+
+// lays leaf errors of blocks of every level out as coverings of a single leaf
+template <int kProfile>
+void setupInnerPropagation(const Vec* __restrict__ block_errors, Storage<VecHolder<Vec>>& coverings_errors,
+                           int num_groups);
+// best coverings of every block of every level by number of leafs, from its subblocks' ones
+template <int kProfile>
+void propagateInner(Storage<VecHolder<Vec>>& coverings_errors, Storage<VecHolder<IVec>>& coverings_num_left_leafs,
+                    int num_groups);
+// concave shell of f, with kInf appended
+std::vector<float> concave(const std::vector<float>& f);
+// min-plus convolution of almost concave instances up to mx leafs
+void minPlusConvolution(const std::vector<float>& left_instance, const std::vector<float>& right_instance,
+                        std::vector<float>& convolution, std::vector<int>& best_left_indices, int mx);
+
+template <typename F, int... kProfiles>
+void withBlockProfile(int profile_num, F&& f, std::integer_sequence<int, kProfiles...>) {
+  ((profile_num == kProfiles && (f(std::integral_constant<int, kProfiles>{}), true)) || ...);
+}
+
+// calls f with std::integral_constant of the profile number, so that it picks kernels of the profile
+template <typename F>
+void withBlockProfile(int profile_num, F&& f) {
+  withBlockProfile(profile_num, f, std::make_integer_sequence<int, kNumBlockProfiles>{});
+}
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <string>
+#include <vector>
+
 #include "image.h"
 
 float MSE(const Channel& c1, const Channel& c2);
@@ -7,3 +10,45 @@ float MSE(const Channel& c1, const Channel& c2);
 float PSNR(float mse, float range = kBitRange);
 float PSNR(const Channel& c1, const Channel& c2);
 float PSNR(const Image& i1, const Image& i2);
+
+// quality of a decoded channel. SSIM is averaged over 8x8 windows with a stride of 4 pixels, MS-SSIM combines it over
+// up to 5 scales of 2x2 box filtered channels
+struct ChannelQuality {
+  double mse_ = 0;
+  float psnr_ = 0;
+  float ssim_ = 0;
+  float ms_ssim_ = 0;
+  // mean squared error of every maximum block of the default block profile, row by row, filled on request. Pixels past
+  // the last whole 4x4 block are left out of it
+  Size map_sz_{0, 0};
+  std::vector<float> block_mse_;
+};
+
+struct Quality {
+  std::vector<ChannelQuality> channels_;
+  // luma is weighted kYChannelWeight times the chroma, as in PSNR of images
+  float psnr_ = 0;
+  float ssim_ = 0;
+  float ms_ssim_ = 0;
+};
+
+// every metric of a scale is taken in a single pass over both channels, which also box filters them for the next
+// scale. Rows of blocks are split between num_threads threads, results do not depend on their number
+ChannelQuality measureQuality(const Channel& reference, const Channel& decoded, bool error_map = false,
+                              int num_threads = 1);
+
+// measures decoded images against one reference, whose channels are extracted once
+class QualityMeter {
+public:
+  QualityMeter(const Image& reference, int num_threads = 1);
+
+  Quality measure(const Image& decoded, bool error_maps = false) const;
+
+private:
+  std::vector<Channel> reference_;
+  int num_threads_;
+};
+
+// writes the error map as a grayscale image with a maximum block of pixels per block, filled with its root mean squared
+// error times kErrorMapGain
+void saveErrorMap(const ChannelQuality& quality, const std::string& path);
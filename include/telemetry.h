@@ -0,0 +1,74 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "trace.h"
+
+// cycles, instructions and last level cache misses
+constexpr int kNumHardwareCounters = 3;
+
+struct StageStats {
+  double seconds_ = 0;
+  int64_t calls_ = 0;
+  // counted only when hardware counters are enabled and the kernel lets us open them
+  bool counted_ = false;
+  std::array<uint64_t, kNumHardwareCounters> hardware_{};
+};
+
+// named stages and counters of a codec run. Stages nest, so the time of a stage includes its substages. A Telemetry
+// is filled by a single thread
+class Telemetry {
+public:
+  // index of the stage, added on first use
+  int stageIndex(std::string_view name);
+  const StageStats* stage(std::string_view name) const;
+  // adds a call of the stage timed by the caller
+  void addStage(std::string_view name, double seconds);
+  double seconds(std::string_view name) const;
+
+  void count(std::string_view name, int64_t value);
+  int64_t counter(std::string_view name) const;
+
+  // adds other's stages and counters under names starting with prefix
+  void merge(const Telemetry& other, const std::string& prefix);
+  std::string json() const;
+
+  // per thread perf_event_open counters for every following stage, silently off where they can not be opened
+  static void enableHardwareCounters(bool enable);
+
+private:
+  friend class ScopedStage;
+
+  std::vector<std::pair<std::string, StageStats>> stages_;
+  std::vector<std::pair<std::string, int64_t>> counters_;
+};
+
+// times its scope as a stage of telemetry, and as a span of the trace timeline when tracing. Clocks and counters are
+// read only at both ends, so scopes belong outside the innermost loops. name should be a string literal
+class ScopedStage {
+public:
+  ScopedStage(Telemetry& telemetry, const char* name);
+  ~ScopedStage();
+
+  ScopedStage(const ScopedStage&) = delete;
+  ScopedStage& operator=(const ScopedStage&) = delete;
+
+private:
+  TraceSpan span_;
+  Telemetry& telemetry_;
+  int stage_;
+  bool counted_;
+  std::array<uint64_t, kNumHardwareCounters> hardware_start_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+// process wide collection of telemetry of every codec run, names of its stages start with prefix
+void recordTelemetry(const std::string& prefix, const Telemetry& telemetry);
+// writes all recorded telemetry as JSON, returns false if the file can not be written
+bool saveTelemetry(const std::string& path);
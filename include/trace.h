@@ -0,0 +1,52 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// timeline of spans of every thread, saved as Chrome trace-event JSON for Perfetto or chrome://tracing. Every thread
+// appends its spans to its own ring buffer that keeps the latest kTraceRingSize of them, with no locks after the first
+// span of the thread. While tracing is off a span costs a relaxed load
+constexpr int kTraceRingSize = 1 << 16;
+
+class Tracer {
+public:
+  static void enable();
+  static bool enabled() { return enabled_.load(std::memory_order_relaxed); }
+  // writes spans of all threads, which should have finished their traced work. Returns false if the file can not be
+  // written
+  static bool save(const std::string& path);
+
+  static int64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+  static void record(const char* name, int arg, int64_t begin_ns, int64_t end_ns);
+
+private:
+  static inline std::atomic<bool> enabled_{false};
+};
+
+// span of its scope. name should outlive the tracer, like a string literal. arg is shown with the span unless negative
+class TraceSpan {
+public:
+  explicit TraceSpan(const char* name, int arg = -1) : name_{Tracer::enabled() ? name : nullptr}, arg_{arg} {
+    if (name_ != nullptr) {
+      begin_ = Tracer::now();
+    }
+  }
+  ~TraceSpan() {
+    if (name_ != nullptr) {
+      Tracer::record(name_, arg_, begin_, Tracer::now());
+    }
+  }
+
+  TraceSpan(const TraceSpan&) = delete;
+  TraceSpan& operator=(const TraceSpan&) = delete;
+
+private:
+  const char* name_;
+  int arg_;
+  int64_t begin_ = 0;
+};
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
 #include <cstring>
 #include <functional>
@@ -11,12 +12,13 @@
 template <typename T>
 class Storage {
 public:
-  T& operator[](int level) { return st_[level - kMinBlockLevel]; }
+  T& operator[](int level) { return st_[level - kMinSupportedLevel]; }
 
-  const T& operator[](int level) const { return st_[level - kMinBlockLevel]; }
+  const T& operator[](int level) const { return st_[level - kMinSupportedLevel]; }
 
 private:
-  std::array<T, kNumBlockLevels> st_;
+  // levels of every block profile
+  std::array<T, kNumSupportedLevels> st_;
 };
 
 typedef float Vec __attribute__((vector_size(kVecBytes)));
@@ -31,6 +33,31 @@ inline void vecArgmin(Vec& __restrict__ base, IVec& __restrict__ base_arg, Vec u
   }
 }
 
+// unaligned loads and stores
+inline Vec loadVec(const float* __restrict__ mem) {
+  Vec v;
+  std::memcpy(&v, mem, kVecBytes);
+  return v;
+}
+
+inline void storeVec(float* __restrict__ mem, Vec v) { std::memcpy(mem, &v, kVecBytes); }
+
+inline float vecSum(Vec v) {
+  float sum = 0;
+  for (int i = 0; i < kVecNumel; ++i) {
+    sum += v[i];
+  }
+  return sum;
+}
+
+inline float vecMax(Vec v) {
+  float max = v[0];
+  for (int i = 1; i < kVecNumel; ++i) {
+    max = std::max(max, v[i]);
+  }
+  return max;
+}
+
 template <typename VType>
 using VecHolder = std::unique_ptr<VType, std::function<void(VType*)>>;
 
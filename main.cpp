@@ -1,24 +1,226 @@
-
-
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <numeric>
+#include <optional>
+#include <span>
 #include <string>
+#include <vector>
 
 #include "interface.h"
 #include "metrics.h"
+#include "telemetry.h"
+#include "trace.h"
 
 int main(int argc, char** argv) {
-  if (argc < 3) {
+  std::vector<std::string> args;
+  bool subsample_chroma = false;
+  bool entropy_coded = false;
+  bool progressive = false;
+  int block_profile = kDefaultBlockProfile;
+  int prefix_bytes = 0;
+  std::string dictionary_path;
+  std::string error_map_path;
+  std::string telemetry_path;
+  std::string trace_path;
+  RestoreParams restore_params;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    auto value = [&](const std::string& option) {
+      return arg.rfind(option, 0) == 0 ? arg.substr(option.size()) : std::string{};
+    };
+    if (arg == "--chroma420") {
+      subsample_chroma = true;
+    } else if (arg == "--entropy") {
+      entropy_coded = true;
+    } else if (arg == "--progressive") {
+      progressive = true;
+    } else if (auto v = value("--block-profile="); !v.empty()) {
+      auto it = std::find(std::begin(kBlockProfileNames), std::end(kBlockProfileNames), v);
+      if (it == std::end(kBlockProfileNames)) {
+        std::cout << "unknown block profile " << v << "\n";
+        return 1;
+      }
+      block_profile = it - std::begin(kBlockProfileNames);
+    } else if (auto v = value("--prefix="); !v.empty()) {
+      prefix_bytes = std::stoi(v);
+    } else if (auto v = value("--max-applies="); !v.empty()) {
+      restore_params.max_applies = std::stoi(v);
+    } else if (auto v = value("--max-delta="); !v.empty()) {
+      restore_params.max_delta = std::stof(v);
+    } else if (auto v = value("--mean-delta="); !v.empty()) {
+      restore_params.mean_delta = std::stof(v);
+    } else if (arg == "--recommended-applies") {
+      restore_params.use_recommended_applies = true;
+    } else if (arg == "--in-place") {
+      restore_params.in_place = true;
+    } else if (auto v = value("--threads="); !v.empty()) {
+      restore_params.num_threads = std::stoi(v);
+    } else if (arg == "--serial-channels") {
+      restore_params.parallel_channels = false;
+    } else if (arg == "--sat-means") {
+      restore_params.sat_means = true;
+    } else if (auto v = value("--scale="); !v.empty()) {
+      restore_params.scale = std::stoi(v);
+    } else if (auto v = value("--roi="); !v.empty()) {
+      std::sscanf(v.c_str(), "%d,%d,%d,%d", &restore_params.roi_offset.first, &restore_params.roi_offset.second,
+                  &restore_params.roi_size.first, &restore_params.roi_size.second);
+    } else if (arg == "--unfused") {
+      restore_params.fused = false;
+    } else if (auto v = value("--dictionary="); !v.empty()) {
+      dictionary_path = v;
+    } else if (auto v = value("--error-map="); !v.empty()) {
+      error_map_path = v;
+    } else if (auto v = value("--telemetry="); !v.empty()) {
+      telemetry_path = v;
+    } else if (auto v = value("--trace="); !v.empty()) {
+      trace_path = v;
+      Tracer::enable();
+    } else if (arg == "--perf-counters") {
+      Telemetry::enableHardwareCounters(true);
+    } else {
+      args.push_back(arg);
+    }
+  }
+  auto saveRecordings = [&] {
+    bool saved = telemetry_path.empty() || saveTelemetry(telemetry_path);
+    return (trace_path.empty() || Tracer::save(trace_path)) && saved;
+  };
+  if (args.size() == 2 && args[0] == "info") {
+    return printStreamInfo(args[1]) ? 0 : 1;
+  }
+  if (args.size() >= 4 && args[0] == "sequence") {
+    int target_size_bytes = std::stoi(args[1]);
+    const std::string& prefix = args[2];
+    SequenceEncoder encoder{subsample_chroma, entropy_coded, block_profile};
+    SequenceDecoder decoder;
+    for (int frame_num = 0; frame_num + 3 < args.size(); ++frame_num) {
+      Image img{args[frame_num + 3]};
+      if (img.size().first == 0) {
+        return 1;
+      }
+      std::string stream_path = prefix + std::to_string(frame_num) + ".fcmp";
+      auto start = std::chrono::high_resolution_clock::now();
+      encoder.compressFrame(img, stream_path, target_size_bytes);
+      auto end = std::chrono::high_resolution_clock::now();
+      Image decompressed = decoder.decompressFrame(stream_path, false, restore_params);
+      if (decompressed.size().first == 0) {
+        return 1;
+      }
+      decompressed.save(prefix + std::to_string(frame_num) + ".png");
+      std::cout << "frame " << frame_num << ": compression time " << std::chrono::duration<double>(end - start).count()
+                << ", size " << std::filesystem::file_size(stream_path) << ", same blocks " << encoder.numSameBlocks();
+      if (decompressed.size() == img.size()) {
+        std::cout << ", PSNR " << PSNR(img, decompressed);
+      }
+      std::cout << std::endl;
+    }
+    return saveRecordings() ? 0 : 1;
+  }
+  if (args.size() < 2) {
     std::cout << "arguments: <reference_image_path>, <target_size_bytes>, <decompressed_image_path>, "
-                 "<compressed_stream_path> <report_timings>\n";
+                 "<compressed_stream_path> <report_timings>\n"
+                 "           info <compressed_stream_path> (print the stream header and chunk index)\n"
+                 "           sequence <target_size_bytes> <output_prefix> <frame_paths>... (code frames against the "
+                 "previous ones)\n"
+                 "options: --chroma420 (code chroma of rgb images at half resolution)\n"
+                 "         --entropy (range code leafs with adaptive contexts)\n"
+                 "         --progressive (order the stream coarse levels first)\n"
+                 "         --block-profile=<default|large|fast> (leaf sizes 2x2 to 32x32, 2x2 to 64x64 or 4x4 to "
+                 "32x32)\n"
+                 "         --prefix=<bytes> (decode only the first bytes of the stream)\n"
+                 "         --max-applies=<n> --max-delta=<x> --mean-delta=<x> (restore iterations cap and "
+                 "convergence thresholds)\n"
+                 "         --recommended-applies (cap restore iterations by the count stored in the stream)\n"
+                 "         --in-place (Gauss-Seidel style restore iterations)\n"
+                 "         --threads=<n> (threads per restore)\n"
+                 "         --serial-channels (decode channels one after another)\n"
+                 "         --sat-means (source block means from summed area table)\n"
+                 "         --unfused (restore through the tiled full size helper)\n"
+                 "         --scale=<n> (decode at 1/n resolution, n is 1, 2, 4 or 8)\n"
+                 "         --roi=<top>,<left>,<height>,<width> (decode only this rectangle of the scaled image)\n"
+                 "         --dictionary=<image_path> (match against a shared dictionary image, decode in one apply)\n"
+                 "         --error-map=<image_path> (save errors of luma maximum blocks and print the worst ones)\n"
+                 "         --telemetry=<json_path> (save times of codec stages and counters as JSON)\n"
+                 "         --perf-counters (count cycles, instructions and LLC misses of every stage)\n"
+                 "         --trace=<json_path> (save a Chrome trace-event timeline of codec threads)\n";
+    return 1;
   }
-  std::string reference_image_path = argv[1];
-  int target_size_bytes = std::atoi(argv[2]);
-  std::string decompressed_image_path = argc > 3 ? argv[3] : "decompressed.png";
-  std::string compressed_stream_path = argc > 4 ? argv[4] : "compressed_stream";
-  bool report_timings = argc > 5 ? (std::string(argv[5]) == "true") : false;
+  std::string reference_image_path = args[0];
+  int target_size_bytes = std::stoi(args[1]);
+  std::string decompressed_image_path = args.size() > 2 ? args[2] : "decompressed.png";
+  std::string compressed_stream_path = args.size() > 3 ? args[3] : "compressed_stream";
+  bool report_timings = args.size() > 4 ? (args[4] == "true") : false;
   Image img{reference_image_path};
-  compressImage(img, compressed_stream_path, target_size_bytes, report_timings);
-  Image decompressed = decompressImage(compressed_stream_path, report_timings);
+  if (img.size().first == 0) {
+    return 1;
+  }
+  std::optional<Dictionary> dictionary;
+  if (!dictionary_path.empty()) {
+    Image dictionary_img{dictionary_path};
+    if (dictionary_img.size().first == 0) {
+      return 1;
+    }
+    dictionary.emplace(dictionary_img);
+    restore_params.dictionary = &*dictionary;
+  }
+  compressImage(img, compressed_stream_path, target_size_bytes, report_timings, subsample_chroma, entropy_coded,
+                progressive, restore_params.dictionary, block_profile);
+  auto decompress = [&] {
+    if (prefix_bytes == 0) {
+      return decompressImage(compressed_stream_path, report_timings, restore_params);
+    }
+    // a cut progressive stream decodes to a coarser image, others are rejected
+    std::ifstream ifs{compressed_stream_path, std::ifstream::binary};
+    std::vector<char> stream{std::istreambuf_iterator<char>{ifs}, std::istreambuf_iterator<char>{}};
+    stream.resize(std::min<size_t>(stream.size(), prefix_bytes));
+    return decompressImage(std::as_bytes(std::span{stream}), report_timings, restore_params);
+  };
+  Image decompressed = decompress();
+  if (decompressed.size().first == 0) {
+    return 1;
+  }
   decompressed.save(decompressed_image_path);
-  std::cout << "PSNR: " << PSNR(img, decompressed) << std::endl;
-}
\ No newline at end of file
+  bool roi = restore_params.roi_size.first > 0 && restore_params.roi_size.second > 0;
+  auto measure = [&](const Image& reference) {
+    return QualityMeter{reference, restore_params.num_threads}.measure(decompressed, !error_map_path.empty());
+  };
+  Quality quality;
+  if (restore_params.scale == 1 && !roi) {
+    quality = measure(img);
+  } else {
+    // reduced resolution or partial decode is compared with box filtered and cropped reference
+    auto channels = img.extractChannels();
+    for (auto& chnl : channels) {
+      for (int scale = 1; scale < restore_params.scale; scale *= 2) {
+        chnl = chnl.subsample();
+      }
+      if (roi) {
+        chnl = chnl.crop(restore_params.roi_offset, restore_params.roi_size);
+      }
+    }
+    quality = measure(Image{channels});
+  }
+  std::cout << "PSNR: " << quality.psnr_ << std::endl;
+  std::cout << "SSIM: " << quality.ssim_ << ", MS-SSIM: " << quality.ms_ssim_ << std::endl;
+  if (!error_map_path.empty()) {
+    constexpr int kNumWorstBlocks = 3;
+    const auto& luma = quality.channels_[0];
+    saveErrorMap(luma, error_map_path);
+    std::vector<int> blocks(luma.block_mse_.size());
+    std::iota(blocks.begin(), blocks.end(), 0);
+    int num_worst = std::min<int>(kNumWorstBlocks, blocks.size());
+    std::partial_sort(blocks.begin(), blocks.begin() + num_worst, blocks.end(),
+                      [&](int l, int r) { return luma.block_mse_[l] > luma.block_mse_[r]; });
+    for (int i = 0; i < num_worst; ++i) {
+      std::cout << "worst block " << blocks[i] / luma.map_sz_.second << "," << blocks[i] % luma.map_sz_.second
+                << ": PSNR " << PSNR(luma.block_mse_[blocks[i]]) << std::endl;
+    }
+  }
+  return saveRecordings() ? 0 : 1;
+}
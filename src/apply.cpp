@@ -0,0 +1,301 @@
+#include <array>
+#include <utility>
+
+#include "decompressor.h"
+
+// in this file kernels are specialised by block level, so every loop bound is known at compile time.
+// Source blocks are passed as "rows" accessors returning pointer to h-th row of the block
+
+// straight rows of the tiled full size helper
+struct StridedRows {
+  const float* __restrict__ src;
+  int stride;
+
+  const float* operator()(int h) const { return src + h * stride; }
+};
+
+// rows of the quarter size helper read with wrapping, rows crossing its right border are gathered into a buffer
+template <int kLevel>
+struct WrappedRows {
+  static constexpr Size kSz = getBlockSize(kLevel);
+
+  WrappedRows(const Channel& helper, int b_row, int b_col) {
+    bool wrap_cols = b_col + kSz.second > helper.width();
+    int r = b_row;
+    for (int h = 0; h < kSz.first; ++h) {
+      const float* row = helper.mem() + r * helper.width();
+      if (!wrap_cols) [[likely]] {
+        rows[h] = row + b_col;
+      } else {
+        for (int w = 0, c = b_col; w < kSz.second; ++w) {
+          buf[h][w] = row[c];
+          c = c + 1 == helper.width() ? 0 : c + 1;
+        }
+        rows[h] = buf[h];
+      }
+      r = r + 1 == helper.height() ? 0 : r + 1;
+    }
+  }
+
+  const float* operator()(int h) const { return rows[h]; }
+
+  const float* rows[kSz.first];
+  float buf[kSz.first][kSz.second];
+};
+
+// sum of source block values, straight or from summed area table
+template <int kLevel, typename Rows>
+inline float blockSum(const Rows& rows, const double* __restrict__ sat, int sat_stride) {
+  constexpr Size kSz = getBlockSize(kLevel);
+  if (sat) {
+    return sat[kSz.first * sat_stride + kSz.second] - sat[kSz.first * sat_stride] - sat[kSz.second] + sat[0];
+  }
+  if constexpr (kSz.second >= kVecNumel) {
+    Vec sum{0};
+    for (int h = 0; h < kSz.first; ++h) {
+      for (int v = 0; v < kSz.second / kVecNumel; ++v) {
+        sum += loadVec(rows(h) + v * kVecNumel);
+      }
+    }
+    return vecSum(sum);
+  } else {
+    float sum = 0;
+    for (int h = 0; h < kSz.first; ++h) {
+      for (int w = 0; w < kSz.second; ++w) {
+        sum += rows(h)[w];
+      }
+    }
+    return sum;
+  }
+}
+
+// sat is the source block corner in summed area table or nullptr to sum the block up
+template <int kLevel, typename Rows>
+inline void applyBlock(float* __restrict__ dst, int stride, const Rows& rows, const double* __restrict__ sat,
+                       int sat_stride, float brightness, Decompressor::Delta& delta) {
+  constexpr Size kSz = getBlockSize(kLevel);
+  constexpr int kNumel = kSz.first * kSz.second;
+  float offset = brightness - blockSum<kLevel>(rows, sat, sat_stride) / kNumel;
+  if constexpr (kSz.second >= kVecNumel) {
+    constexpr int kRowVecs = kSz.second / kVecNumel;
+    Vec max_diff{0};
+    Vec sum_diff{0};
+    for (int h = 0; h < kSz.first; ++h) {
+      for (int v = 0; v < kRowVecs; ++v) {
+        Vec next = loadVec(rows(h) + v * kVecNumel) + offset;
+        Vec diff = next - loadVec(dst + h * stride + v * kVecNumel);
+        diff = diff < 0 ? -diff : diff;
+        max_diff = diff > max_diff ? diff : max_diff;
+        sum_diff += diff;
+        storeVec(dst + h * stride + v * kVecNumel, next);
+      }
+    }
+    delta.max_ = std::max(delta.max_, vecMax(max_diff));
+    delta.sum_ += vecSum(sum_diff);
+  } else {
+    float max_diff = 0;
+    float sum_diff = 0;
+    for (int h = 0; h < kSz.first; ++h) {
+      for (int w = 0; w < kSz.second; ++w) {
+        float next = rows(h)[w] + offset;
+        float diff = std::abs(next - dst[h * stride + w]);
+        max_diff = std::max(max_diff, diff);
+        sum_diff += diff;
+        dst[h * stride + w] = next;
+      }
+    }
+    delta.max_ = std::max(delta.max_, max_diff);
+    delta.sum_ += sum_diff;
+  }
+}
+
+// writes translated block straight into the next helper: 2x2 average of (source + offset) scaled by kAlpha.
+// next and cur point to the block's position in quarter size helpers
+template <int kLevel, typename Rows>
+inline void fuseBlock(float* __restrict__ next, const float* __restrict__ cur, int helper_stride, const Rows& rows,
+                      float brightness, Decompressor::Delta& delta) {
+  constexpr Size kSz = getBlockSize(kLevel);
+  constexpr int kNumel = kSz.first * kSz.second;
+  float offset = (brightness - blockSum<kLevel>(rows, nullptr, 0) / kNumel) * kAlpha;
+  constexpr float kMul = kAlpha / 4;
+  if constexpr (kSz.second >= kVecNumel * 2) {
+    Vec max_diff{0};
+    Vec sum_diff{0};
+    for (int h = 0; h < kSz.first / 2; ++h) {
+      for (int v = 0; v < kSz.second / kVecNumel / 2; ++v) {
+        Vec l = loadVec(rows(h * 2) + v * kVecNumel * 2) + loadVec(rows(h * 2 + 1) + v * kVecNumel * 2);
+        Vec r = loadVec(rows(h * 2) + v * kVecNumel * 2 + kVecNumel) +
+                loadVec(rows(h * 2 + 1) + v * kVecNumel * 2 + kVecNumel);
+        Vec even = __builtin_shufflevector(l, r, 0, 2, 4, 6, 8, 10, 12, 14);
+        Vec odd = __builtin_shufflevector(l, r, 1, 3, 5, 7, 9, 11, 13, 15);
+        Vec val = (even + odd) * kMul + offset;
+        Vec diff = val - loadVec(cur + h * helper_stride + v * kVecNumel);
+        diff = diff < 0 ? -diff : diff;
+        max_diff = diff > max_diff ? diff : max_diff;
+        sum_diff += diff;
+        storeVec(next + h * helper_stride + v * kVecNumel, val);
+      }
+    }
+    delta.max_ = std::max(delta.max_, vecMax(max_diff));
+    delta.sum_ += vecSum(sum_diff);
+  } else {
+    float max_diff = 0;
+    float sum_diff = 0;
+    for (int h = 0; h < kSz.first / 2; ++h) {
+      const float* r0 = rows(h * 2);
+      const float* r1 = rows(h * 2 + 1);
+      for (int w = 0; w < kSz.second / 2; ++w) {
+        float val = (r0[w * 2] + r0[w * 2 + 1] + r1[w * 2] + r1[w * 2 + 1]) * kMul + offset;
+        float diff = std::abs(val - cur[h * helper_stride + w]);
+        max_diff = std::max(max_diff, diff);
+        sum_diff += diff;
+        next[h * helper_stride + w] = val;
+      }
+    }
+    delta.max_ = std::max(delta.max_, max_diff);
+    delta.sum_ += sum_diff;
+  }
+}
+
+template <int kLevel>
+void applyBucket(const TranslationBucket& bucket, float* __restrict__ dst, const HelperImage& src, int stride,
+                 Decompressor::Delta& delta) {
+  const int* __restrict__ a_mem_offsets = bucket.a_mem_offsets_.data();
+  const int* __restrict__ b_mem_offsets = bucket.b_mem_offsets_.data();
+  const int* __restrict__ b_sat_offsets = bucket.b_sat_offsets_.data();
+  const float* __restrict__ brightness = bucket.brightness_.data();
+  const float* __restrict__ src_mem = src.channel().mem();
+  const double* __restrict__ sat = src.sat();
+  for (int i = 0; i < bucket.a_mem_offsets_.size(); ++i) {
+    applyBlock<kLevel>(dst + a_mem_offsets[i], stride, StridedRows{src_mem + b_mem_offsets[i], stride},
+                       sat ? sat + b_sat_offsets[i] : nullptr, src.satStride(), brightness[i], delta);
+  }
+}
+
+template <int kLevel>
+void applyWrappedBucket(const TranslationBucket& bucket, float* __restrict__ dst, const Channel& helper, int stride,
+                        Decompressor::Delta& delta) {
+  for (int i = 0; i < bucket.a_mem_offsets_.size(); ++i) {
+    WrappedRows<kLevel> rows{helper, bucket.b_rows_[i], bucket.b_cols_[i]};
+    applyBlock<kLevel>(dst + bucket.a_mem_offsets_[i], stride, rows, nullptr, 0, bucket.brightness_[i], delta);
+  }
+}
+
+template <int kLevel>
+void fuseBucket(const TranslationBucket& bucket, float* __restrict__ next, const Channel& cur,
+                Decompressor::Delta& delta) {
+  for (int i = 0; i < bucket.a_mem_offsets_.size(); ++i) {
+    WrappedRows<kLevel> rows{cur, bucket.b_rows_[i], bucket.b_cols_[i]};
+    int offset = bucket.a_helper_offsets_[i];
+    fuseBlock<kLevel>(next + offset, cur.mem() + offset, cur.width(), rows, bucket.brightness_[i], delta);
+  }
+}
+
+using BlockKernel = void (*)(float*, int, const StridedRows&, const double*, int, float, Decompressor::Delta&);
+using BucketKernel = void (*)(const TranslationBucket&, float*, const HelperImage&, int, Decompressor::Delta&);
+using WrappedBucketKernel = void (*)(const TranslationBucket&, float*, const Channel&, int, Decompressor::Delta&);
+using FuseBucketKernel = void (*)(const TranslationBucket&, float*, const Channel&, Decompressor::Delta&);
+
+// kernels of every level of any profile, indexed by level - kMinSupportedLevel
+template <int... kLevels>
+constexpr std::array<BlockKernel, kNumSupportedLevels> makeBlockKernels(std::integer_sequence<int, kLevels...>) {
+  return {&applyBlock<kMinSupportedLevel + kLevels, StridedRows>...};
+}
+
+template <int... kLevels>
+constexpr std::array<BucketKernel, kNumSupportedLevels> makeBucketKernels(std::integer_sequence<int, kLevels...>) {
+  return {&applyBucket<kMinSupportedLevel + kLevels>...};
+}
+
+template <int... kLevels>
+constexpr std::array<WrappedBucketKernel, kNumSupportedLevels> makeWrappedBucketKernels(
+    std::integer_sequence<int, kLevels...>) {
+  return {&applyWrappedBucket<kMinSupportedLevel + kLevels>...};
+}
+
+template <int... kLevels>
+constexpr std::array<FuseBucketKernel, kNumSupportedLevels> makeFuseBucketKernels(
+    std::integer_sequence<int, kLevels...>) {
+  return {&fuseBucket<kMinSupportedLevel + kLevels>...};
+}
+
+constexpr auto kBlockKernels = makeBlockKernels(std::make_integer_sequence<int, kNumSupportedLevels>{});
+constexpr auto kBucketKernels = makeBucketKernels(std::make_integer_sequence<int, kNumSupportedLevels>{});
+constexpr auto kWrappedBucketKernels = makeWrappedBucketKernels(std::make_integer_sequence<int, kNumSupportedLevels>{});
+constexpr auto kFuseBucketKernels = makeFuseBucketKernels(std::make_integer_sequence<int, kNumSupportedLevels>{});
+
+void Decompressor::buildBuckets() {
+  int hh = sz_.first / 2;
+  int hw = sz_.second / 2;
+  band_buckets_.clear();
+  band_buckets_.resize(sz_.first / band_height_);
+  for (const auto& tr : translations_) {
+    int band = tr.a_mem_offset_ / sz_.second / band_height_;
+    auto& bucket = band_buckets_[band][tr.level_];
+    bucket.a_mem_offsets_.push_back(tr.a_mem_offset_);
+    bucket.b_mem_offsets_.push_back(tr.b_mem_offset_);
+    bucket.b_sat_offsets_.push_back(HelperImage::satOffset(sz_, tr.b_mem_offset_));
+    bucket.a_helper_offsets_.push_back(tr.a_mem_offset_ / sz_.second / 2 * hw +
+                                       tr.a_mem_offset_ % sz_.second / 2);
+    bucket.b_rows_.push_back(tr.b_mem_offset_ / sz_.second % hh);
+    bucket.b_cols_.push_back(tr.b_mem_offset_ % sz_.second % hw);
+    bucket.brightness_.push_back(tr.brightness_);
+  }
+}
+
+Decompressor::Delta Decompressor::applyBand(int band, Channel& dst, const HelperImage& src) const {
+  Delta delta;
+  for (int level = kMinSupportedLevel; level <= metadata_.profile_.max_level_; ++level) {
+    kBucketKernels[level - kMinSupportedLevel](band_buckets_[band][level], dst.mem(), src, sz_.second, delta);
+  }
+  return delta;
+}
+
+Decompressor::Delta Decompressor::applyBand(int band, Channel& dst, const Channel& helper) const {
+  Delta delta;
+  for (int level = kMinSupportedLevel; level <= metadata_.profile_.max_level_; ++level) {
+    kWrappedBucketKernels[level - kMinSupportedLevel](band_buckets_[band][level], dst.mem(), helper, sz_.second,
+                                                      delta);
+  }
+  return delta;
+}
+
+Decompressor::Delta Decompressor::fuseBand(int band, Channel& next_helper, const Channel& helper) const {
+  Delta delta;
+  for (int level = kMinSupportedLevel; level <= metadata_.profile_.max_level_; ++level) {
+    kFuseBucketKernels[level - kMinSupportedLevel](band_buckets_[band][level], next_helper.mem(), helper, delta);
+  }
+  return delta;
+}
+
+Decompressor::Delta Decompressor::apply(Channel& dst, const HelperImage& src) const {
+  Delta delta;
+  for (int band = 0; band < band_buckets_.size(); ++band) {
+    delta.add(applyBand(band, dst, src));
+  }
+  return delta;
+}
+
+Decompressor::Delta Decompressor::applyInPlace(Channel& dst, Channel& helper) const {
+  Delta delta;
+  int hh = sz_.first / 2;
+  int hw = sz_.second / 2;
+  for (int tr_num : in_place_order_) {
+    const auto& tr = translations_[tr_num];
+    // helper changes within a sweep, so blocks are summed up straight
+    kBlockKernels[tr.level_ - kMinSupportedLevel](dst.mem() + tr.a_mem_offset_, sz_.second,
+                                                  StridedRows{helper.mem() + tr.b_mem_offset_, sz_.second}, nullptr,
+                                                  0, tr.brightness_, delta);
+    // same as downsampleTo restricted to this block and its tiled copies
+    int ah = tr.a_mem_offset_ / sz_.second;
+    int aw = tr.a_mem_offset_ % sz_.second;
+    for (int h = ah; h < ah + tr.sz_.first; h += 2) {
+      for (int w = aw; w < aw + tr.sz_.second; w += 2) {
+        float v = (dst.get(h, w) + dst.get(h, w + 1) + dst.get(h + 1, w) + dst.get(h + 1, w + 1)) / 4 * kAlpha;
+        helper.get(h / 2, w / 2) = helper.get(h / 2, w / 2 + hw) = helper.get(h / 2 + hh, w / 2) =
+            helper.get(h / 2 + hh, w / 2 + hw) = v;
+      }
+    }
+  }
+  return delta;
+}
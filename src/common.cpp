@@ -1,16 +1,16 @@
 #include "common.h"
 
-Pattern::Pattern(Size sz) : sz_{sz} {
-  for (int level = kMaxBlockLevel; level >= kMinBlockLevel; --level) {
-    pattern_[level].resize(kMaxBlockNumel / getBlockNumel(level));
+Pattern::Pattern(Size sz, const BlockProfile& profile) : sz_{sz}, min_level_{profile.min_level_} {
+  for (int level = profile.max_level_; level >= profile.min_level_; --level) {
+    pattern_[level].resize(profile.max_numel_ / getBlockNumel(level));
   }
   Offset start_offset{0, 0};
-  build(kMaxBlockLevel, 0, start_offset);
+  build(profile.max_level_, 0, start_offset);
 }
 
 void Pattern::build(int level, int block_num, Offset ofs) {
   pattern_[level][block_num] = ofs.first * sz_.second + ofs.second;
-  if (level == kMinBlockLevel) {
+  if (level == min_level_) {
     return;
   }
   auto cur_sz = getBlockSize(level);
@@ -21,9 +21,10 @@ void Pattern::build(int level, int block_num, Offset ofs) {
         Offset{ofs.first + cur_sz.first - prev_sz.first, ofs.second + cur_sz.second - prev_sz.second});
 }
 
-Metadata::Metadata(Size sz) : sz_{sz}, pt_{sz} {
-  for (int h = 0; h < sz.first; h += kMaximumBlockSize.first) {
-    for (int w = 0; w < sz.second; w += kMaximumBlockSize.second) {
+Metadata::Metadata(Size sz, int profile_num)
+    : sz_{sz}, profile_num_{profile_num}, profile_{kBlockProfiles[profile_num]}, pt_{sz, profile_} {
+  for (int h = 0; h < sz.first; h += profile_.max_size_.first) {
+    for (int w = 0; w < sz.second; w += profile_.max_size_.second) {
       int offset = h * sz.second + w;
       a_block_offsets_.push_back(offset);
     }
@@ -60,9 +61,14 @@ Metadata::Metadata(Size sz) : sz_{sz}, pt_{sz} {
   num_b_groups_ = b_block_offsets_.size() / kVecNumel;
 
   int level_offset = 0;
-  for (int level = kMinBlockLevel; level <= kMaxBlockLevel; ++level) {
+  for (int level = profile_.min_level_; level <= profile_.max_level_; ++level) {
     level_offsets_[level] = level_offset;
-    level_offset += kMaxBlockNumel / getBlockNumel(level);
-    num_min_blocks_in_level_[level] = getBlockNumel(level) / kMinBlockNumel;
+    level_offset += profile_.max_numel_ / getBlockNumel(level);
+    num_min_blocks_in_level_[level] = getBlockNumel(level) / profile_.min_numel_;
   }
 }
+
+int renormalize(int brightness, std::pair<int, int> from, std::pair<int, int> to) {
+  float value = brightness * (from.second - from.first) / float(kBitRange) + from.first;
+  return clamp((value - to.first) * kBitRange / float(to.second - to.first));
+}
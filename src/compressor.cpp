@@ -1,95 +1,197 @@
 #include "compressor.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <iostream>
+#include <optional>
 
+#include "decompressor.h"
+#include "dictionary.h"
+#include "header.h"
 #include "interface.h"
 #include "metrics.h"
 
-ReusableBuffers::ReusableBuffers(int num_a_groups) {
-  a_groups_ = allocVecs(num_a_groups * kMaxBlockNumel);
-  a_sumsq_ = allocVecs(num_a_groups * kMinBlocksInMax);
+ReusableBuffers::ReusableBuffers(int num_a_groups, const BlockProfile& profile) {
+  a_groups_ = allocVecs(num_a_groups * profile.max_numel_);
+  a_sumsq_ = allocVecs(num_a_groups * profile.min_blocks_in_max_);
 
-  b_groups_ = allocVecs(kMaxBlockNumel);
-  b_mean_ = allocVecs(kMinBlocksInMax * 2);
-  b_sumsq_ = allocVecs(kMinBlocksInMax);
+  b_groups_ = allocVecs(profile.max_numel_);
+  b_mean_ = allocVecs(profile.min_blocks_in_max_ * 2);
+  b_sumsq_ = allocVecs(profile.min_blocks_in_max_);
 }
 
-Compressor::Compressor(const Channel& chl, const Metadata& metadata, ReusableBuffers& buffers)
-    : a_chl_{chl}, b_chl_{a_chl_.like()}, metadata_{metadata}, rbuf_{buffers} {
-  a_mean_ = allocVecs(metadata_.num_a_groups_ * kMinBlocksInMax * 2);
-  block_errors_ = allocVecs(metadata_.num_a_groups_ * kMinBlocksInMax * 2);
-  block_matches_indices_ = allocVecs<IVec>(metadata_.num_a_groups_ * kMinBlocksInMax * 2);
+Compressor::Compressor(const Channel& chl, const Metadata& metadata, ReusableBuffers& buffers, ChannelHistory* history,
+                       const Channel* domain)
+    : a_chl_{chl},
+      b_chl_{domain != nullptr ? Channel{Size{0, 0}} : a_chl_.like()},
+      domain_{domain},
+      metadata_{metadata},
+      rbuf_{buffers},
+      history_{history} {
+  const auto& profile = metadata_.profile_;
+  a_mean_ = allocVecs(metadata_.num_a_groups_ * profile.min_blocks_in_max_ * 2);
+  block_errors_ = allocVecs(metadata_.num_a_groups_ * profile.min_blocks_in_max_ * 2);
+  block_matches_indices_ = allocVecs<IVec>(metadata_.num_a_groups_ * profile.min_blocks_in_max_ * 2);
 
-  for (int level = kMinBlockLevel; level <= kMaxBlockLevel; ++level) {
-    coverings_errors_[level] = allocVecs(metadata_.num_a_groups_ * kMinBlocksInMax);
-    coverings_num_leafs_in_left_[level] = allocVecs<IVec>(metadata_.num_a_groups_ * kMinBlocksInMax);
+  for (int level = profile.min_level_; level <= profile.max_level_; ++level) {
+    coverings_errors_[level] = allocVecs(metadata_.num_a_groups_ * profile.min_blocks_in_max_);
+    coverings_num_leafs_in_left_[level] = allocVecs<IVec>(metadata_.num_a_groups_ * profile.min_blocks_in_max_);
   }
 }
 
-std::vector<float> Compressor::setupCompressionState(int target_num_leafs) {
-  assert(a_chl_.height() % kMaximumBlockSize.first == 0 && a_chl_.width() % kMaximumBlockSize.second == 0);
+void Compressor::setupHelper() {
+  assert(a_chl_.height() % metadata_.profile_.max_size_.first == 0 &&
+         a_chl_.width() % metadata_.profile_.max_size_.second == 0);
 
-  auto start = std::chrono::high_resolution_clock::now();
+  ScopedStage stage{telemetry_, "helper"};
+  if (domain_ == nullptr) {
+    a_chl_.downsampleTo(b_chl_);
+  }
+  findSameBlocks();
+}
 
-  a_chl_.downsampleTo(b_chl_);
+std::vector<float> Compressor::setupCompressionState(int target_num_leafs) {
+  ScopedStage stage{telemetry_, "setup"};
   matchBlocks();
-  auto result = propagate(target_num_leafs);
-
-  auto end = std::chrono::high_resolution_clock::now();
-  total_setup_time_ = std::chrono::duration<double>(end - start);
-  return result;
+  return propagate(target_num_leafs);
 }
 
-void Compressor::serialize(int target_num_leafs, WStream& stream) {
-  auto start = std::chrono::high_resolution_clock::now();
-
-  auto leafs_per_block = propagator_.distributeLeafs(target_num_leafs);
-  serializeNodes(stream, leafs_per_block);
-
-  auto end = std::chrono::high_resolution_clock::now();
-  serialization_time_ = std::chrono::duration<double>(end - start);
+std::vector<std::vector<char>> Compressor::serialize(int target_num_leafs, bool entropy_coded, int rows_per_chunk) {
+  ScopedStage stage{telemetry_, "serialization"};
+  leafs_per_block_ = propagator_.distributeLeafs(target_num_leafs);
+  return serializeNodes(leafs_per_block_, entropy_coded, rows_per_chunk);
 }
 
 void Compressor::reportTimings() const {
-  std::cout << "channel compression time:" << total_setup_time_.count() + serialization_time_.count() << "\n";
-  std::cout << "setup time: " << total_setup_time_.count() << "\n";
-  std::cout << "reorder time: " << reorder_time_.count() << "\n";
-  std::cout << "match time: " << match_time_.count() << "\n";
-  std::cout << "reduce time: " << reduce_time_.count() << "\n";
-  std::cout << "internal propagation time: " << int_prop_time_.count() << std::endl;
-  std::cout << "external propagation time: " << ext_prop_time_.count() << std::endl;
-  std::cout << "serialization time: " << serialization_time_.count() << "\n";
+  const auto& t = telemetry_;
+  std::cout << "channel compression time:" << t.seconds("helper") + t.seconds("setup") + t.seconds("serialization")
+            << "\n";
+  std::cout << "helper time: " << t.seconds("helper") << "\n";
+  std::cout << "setup time: " << t.seconds("setup") << "\n";
+  std::cout << "reorder time: " << t.seconds("reorder") << "\n";
+  std::cout << "match time: " << t.seconds("match") << "\n";
+  std::cout << "internal propagation time: " << t.seconds("internal propagation") << std::endl;
+  std::cout << "external propagation time: " << t.seconds("external propagation") << std::endl;
+  std::cout << "serialization time: " << t.seconds("serialization") << "\n";
+  if (!same_blocks_.empty()) {
+    std::cout << "same blocks: " << t.counter("same blocks") << "\n";
+    std::cout << "fully searched groups: " << t.counter("fully searched groups") << "\n";
+  }
   std::cout << "\n";
 }
 
-void compressImage(const Image& img, const std::string& filepath, int target_size_bytes, bool report_timings) {
+// codes an image, or a frame of the sequence against its previous frame if sequence is given
+static void compressStream(const Image& img, const std::string& filepath, int target_size_bytes, bool report_timings,
+                           bool subsample_chroma, bool entropy_coded, bool progressive, SequenceState* sequence,
+                           const Dictionary* dictionary, int block_profile) {
   auto start = std::chrono::high_resolution_clock::now();
-  assertWithMessage(
-      img.size().first % kMaximumBlockSize.first == 0 && img.size().second % kMaximumBlockSize.second == 0,
-      "image shapes should be divisible by kMaximumBlockSize");
-  assertWithMessage(
-      img.size().first % kMaximumBlockSize.first == 0 && img.size().second % kMaximumBlockSize.second == 0,
-      "image shapes should be divisible by kMaximumBlockSize");
+  if (block_profile < 0 || block_profile >= kNumBlockProfiles) {
+    assertWithMessage(false, "unknown block profile, coding with the default one");
+    block_profile = kDefaultBlockProfile;
+  }
+  auto divides = [&](int profile) {
+    Size max_size = kBlockProfiles[profile].max_size_;
+    return img.size().first % max_size.first == 0 && img.size().second % max_size.second == 0;
+  };
+  if (!divides(block_profile)) {
+    assertWithMessage(false, "image shapes should be divisible by the maximum block size of the block profile, coding "
+                             "with the default one");
+    block_profile = kDefaultBlockProfile;
+  }
+  Size max_block_size = kBlockProfiles[block_profile].max_size_;
+  assertWithMessage(divides(block_profile), "image shapes should be divisible by the maximum block size");
   assertWithMessage(img.size().first < kMaxShape && img.size().second < kMaxShape, "image shapes are too big");
+  if (dictionary != nullptr) {
+    bool fits = dictionary->size() == img.size() && dictionary->numChannels() == img.numChannels();
+    assertWithMessage(fits, "dictionary should have the shape and channels of the image, coding the image on its own");
+    dictionary = fits ? dictionary : nullptr;
+  }
+
+  Metadata metadata{img.size(), block_profile};
+
+  subsample_chroma = subsample_chroma && img.numChannels() == 3;
+  if (subsample_chroma) {
+    subsample_chroma =
+        img.size().first % (max_block_size.first * 2) == 0 && img.size().second % (max_block_size.second * 2) == 0;
+    assertWithMessage(subsample_chroma,
+                      "image shapes should be divisible by 2 * maximum block size to subsample chroma, coding it at "
+                      "full resolution");
+  }
+  assertWithMessage(!progressive || !entropy_coded, "progressive layout is coded raw, ignoring entropy coding");
+  entropy_coded = entropy_coded && !progressive;
+  // full resolution channels are normalized right in the conversion pass, subsampled chroma gets its range after
+  // subsampling
+  std::vector<Channel> channels;
+  std::vector<std::pair<int, int>> ranges;
+  std::optional<Metadata> chroma_metadata;
+  if (subsample_chroma) {
+    channels = img.extractChannels();
+    chroma_metadata.emplace(Size{img.size().first / 2, img.size().second / 2}, block_profile);
+    for (int channel_num = 1; channel_num < channels.size(); ++channel_num) {
+      channels[channel_num] = channels[channel_num].subsample();
+    }
+    for (const auto& chnl : channels) {
+      ranges.push_back(Channel::rangeOf(chnl.getStats()));
+    }
+  } else {
+    for (auto stats : img.channelsStats()) {
+      ranges.push_back(Channel::rangeOf(stats));
+    }
+  }
+  // frames of a sequence are coded against the previous frame, leafs repeated from it are renormalized to the ranges
+  // of the frame. A frame of another shape is coded on its own and starts the sequence over
+  bool inter = sequence != nullptr && !sequence->channels_.empty() && sequence->sz_ == img.size() &&
+               sequence->channels_.size() == ranges.size();
+  if (inter) {
+    for (int channel_num = 0; channel_num < ranges.size(); ++channel_num) {
+      sequence->channels_[channel_num].renormalize(sequence->ranges_[channel_num], ranges[channel_num]);
+    }
+    sequence->ranges_ = ranges;
+  } else if (sequence != nullptr) {
+    *sequence = SequenceState{img.size(), ranges, std::vector<ChannelHistory>(ranges.size())};
+  }
+  if (subsample_chroma) {
+    for (int channel_num = 0; channel_num < channels.size(); ++channel_num) {
+      channels[channel_num].normalize(ranges[channel_num]);
+    }
+  } else {
+    channels = img.extractNormalizedChannels(ranges);
+  }
+  auto metadataFor = [&](int channel_num) -> const Metadata& {
+    return channel_num > 0 && chroma_metadata ? *chroma_metadata : metadata;
+  };
 
-  WStream stream{};
-  Metadata metadata{img.size()};
-  ReusableBuffers buf{metadata.num_a_groups_};
+  // luma has the most groups, so buffers sized for it fit every channel
+  ReusableBuffers buf{metadata.num_a_groups_, metadata.profile_};
 
-  auto channels = img.extractChannels();
+  int num_base_leafs = 0;
+  int num_min_blocks = 0;
+  for (const auto& chnl : channels) {
+    num_base_leafs += chnl.numel() / metadata.profile_.max_numel_;
+    num_min_blocks += chnl.numel() / metadata.profile_.min_numel_;
+  }
+  StreamHeader header{metadata.sz_, static_cast<int>(channels.size()), subsample_chroma, entropy_coded, progressive,
+                      inter, dictionary != nullptr, dictionary != nullptr ? dictionary->id() : 0, block_profile, 0,
+                      ranges};
 
-  int num_base_leafs = img.size().first * img.size().second / kMaxBlockNumel * channels.size();
-  int bits_for_leaf = metadata.bits_for_match_idx_ + kBitDepth + 2;  // 2 is for "is leaf block" flags
+  // subsampled chroma has fewer sources, so its match indices are narrower. Leafs are counted at the cheapest channel's
+  // cost, an upper bound the size search below narrows down
+  int bits_for_match_idx = metadata.bits_for_match_idx_;
+  for (int channel_num = 1; channel_num < channels.size(); ++channel_num) {
+    bits_for_match_idx = std::min(bits_for_match_idx, metadataFor(channel_num).bits_for_match_idx_);
+  }
+  int bits_for_leaf = bits_for_match_idx + kBitDepth + 2;  // 2 is for "is leaf block" flags
   int target_size_bits = target_size_bytes * CHAR_BIT;
-  int num_metadata_bits = kBitsPerShape * 2 + kBitsForNumChannels + channels.size() * kRangeOffset;
+  int num_metadata_bits = header.numFieldBits();
   // ... + num_base_leafs to account that we don't serialize a "split" flag for base blocks
   int target_num_leafs = (target_size_bits - num_metadata_bits + num_base_leafs) / bits_for_leaf;
-  target_num_leafs = std::max(target_num_leafs, num_base_leafs);
-  stream.dump(metadata.sz_.first, kBitsPerShape);
-  stream.dump(metadata.sz_.second, kBitsPerShape);
-  stream.dump(channels.size(), kBitsForNumChannels);
+  target_num_leafs = std::clamp(target_num_leafs, num_base_leafs, num_min_blocks);
+  // coded leafs are cheaper than raw ones, so coverings are built for more of them. In both modes the number of leafs
+  // fitting the target together with the chunk index and chunk padding is then searched by stream size
+  if (entropy_coded) {
+    target_num_leafs = std::min(target_num_leafs * kMaxEntropyCodingGain, num_min_blocks);
+  }
 
   std::vector<Compressor> compressors;
   std::vector<std::vector<float>> channel_errors;
@@ -101,12 +203,33 @@ void compressImage(const Image& img, const std::string& filepath, int target_siz
 
   for (int channel_num = 0; channel_num < channels.size(); ++channel_num) {
     auto& chnl = channels[channel_num];
-
-    auto range = chnl.normalize();
-    stream.dump(range.first + kBitRange, kRangeOffset);
-    stream.dump(range.second + kBitRange, kRangeOffset);
-    compressors.emplace_back(chnl, metadata, buf);
-    auto& comp = compressors.back();
+    const Channel* domain = dictionary != nullptr ? &dictionary->helper(channel_num, chnl.size())->channel() : nullptr;
+    compressors.emplace_back(chnl, metadataFor(channel_num), buf,
+                             sequence != nullptr ? &sequence->channels_[channel_num] : nullptr, domain);
+    compressors.back().setupHelper();
+  }
+  // after a scene cut the previous frame's leafs fit far worse than they did, searching around their matches misses
+  // the better ones and same flags only cost. Such frames are coded on their own
+  if (inter) {
+    float error = 0;
+    float reference_error = 0;
+    for (const auto& comp : compressors) {
+      auto [channel_error, channel_reference_error] = comp.historyErrors();
+      error += channel_error;
+      reference_error += channel_reference_error;
+    }
+    if (error > reference_error * kSceneCutErrorRatio) {
+      for (auto& comp : compressors) {
+        comp.dropHistory();
+      }
+      inter = false;
+      header.inter_ = false;
+    }
+  }
+  for (int channel_num = 0; channel_num < channels.size(); ++channel_num) {
+    TraceSpan span{"encode channel", channel_num};
+    auto& chnl = channels[channel_num];
+    auto& comp = compressors[channel_num];
     auto erorrs = comp.setupCompressionState(target_num_leafs);
     for (auto& e : erorrs) {
       e = -PSNR(e / chnl.numel()) * weights[channel_num];
@@ -116,19 +239,109 @@ void compressImage(const Image& img, const std::string& filepath, int target_siz
 
   Propagator prop{};
   prop.propagate(channel_errors, target_num_leafs);
-  auto leafs_for_channel = prop.distributeLeafs(target_num_leafs - 1);
-  for (int channel_num = 0; channel_num < channels.size(); ++channel_num) {
-    compressors[channel_num].serialize(leafs_for_channel[channel_num], stream);
-    if (report_timings) {
+  auto serialize = [&](int num_leafs) {
+    auto leafs_for_channel = prop.distributeLeafs(num_leafs - 1);
+    if (progressive) {
+      WStream stream{};
+      header.write(stream, {});
+      for (int channel_num = 0; channel_num < channels.size(); ++channel_num) {
+        compressors[channel_num].serializeBase(leafs_for_channel[channel_num], stream);
+      }
+      for (int level = metadata.profile_.max_level_; level > metadata.profile_.min_level_; --level) {
+        for (auto& comp : compressors) {
+          comp.serializeRefinements(level, stream);
+        }
+      }
+      return stream;
+    }
+    std::vector<std::vector<std::vector<char>>> chunks;
+    for (int channel_num = 0; channel_num < channels.size(); ++channel_num) {
+      chunks.push_back(compressors[channel_num].serialize(leafs_for_channel[channel_num], header.entropy_coded_,
+                                                          header.rows_per_chunk_));
+    }
+    WStream stream{};
+    header.write(stream, chunks);
+    return stream;
+  };
+  // contexts restart with every chunk, so entropy coded chunks span several rows of maximum blocks
+  int blocks_per_row = metadata.sz_.second / metadata.profile_.max_size_.second;
+  int num_rows = metadata.sz_.first / metadata.profile_.max_size_.first;
+  int entropy_rows_per_chunk = std::min((kMinEntropyChunkBlocks + blocks_per_row - 1) / blocks_per_row, num_rows);
+  auto searchNumLeafs = [&](bool coded) {
+    header.entropy_coded_ = coded;
+    header.rows_per_chunk_ = coded ? entropy_rows_per_chunk : 1;
+    int lo = num_base_leafs;
+    int hi = target_num_leafs;
+    while (lo < hi) {
+      int mid = (lo + hi + 1) / 2;
+      if (serialize(mid).numBits() <= target_size_bits) {
+        lo = mid;
+      } else {
+        hi = mid - 1;
+      }
+    }
+    return lo;
+  };
+  int num_leafs = searchNumLeafs(entropy_coded);
+  // adaptive contexts cost more than they save on few leafs, so such streams are written raw
+  if (entropy_coded) {
+    int raw_num_leafs = searchNumLeafs(false);
+    num_leafs = std::max(num_leafs, raw_num_leafs);
+    entropy_coded = num_leafs > raw_num_leafs;
+    header.entropy_coded_ = entropy_coded;
+    header.rows_per_chunk_ = entropy_coded ? entropy_rows_per_chunk : 1;
+  }
+  WStream stream = serialize(num_leafs);
+  if (report_timings) {
+    for (int channel_num = 0; channel_num < channels.size(); ++channel_num) {
       std::cout << "channel " << std::to_string(channel_num) << ":\n";
       compressors[channel_num].reportTimings();
     }
+    std::cout << "leafs: " << num_leafs << "\n";
   }
 
+  if (sequence != nullptr) {
+    sequence->num_same_blocks_ = 0;
+    for (auto& comp : compressors) {
+      comp.updateHistory();
+      const auto& same_blocks = comp.sameBlocks();
+      sequence->num_same_blocks_ += std::count(same_blocks.begin(), same_blocks.end(), true);
+    }
+  }
+
+  // the decoder converges in the same number of iterations, so the encoder measures it once for everyone. Decoding
+  // also leaves the translations the decoder of a sequence keeps for the next frame
+  auto* decoded = sequence != nullptr ? &sequence->decoded_ : nullptr;
+  StreamHeader::patchNumApplies(stream, recommendNumApplies(stream.bytes(), decoded));
+
   stream.save(filepath);
   auto end = std::chrono::high_resolution_clock::now();
   auto total_compression_time = std::chrono::duration<double>(end - start);
   if (report_timings) {
     std::cout << "total compression time: " << total_compression_time.count() << "\n\n";
   }
+  Telemetry telemetry;
+  telemetry.addStage("total", total_compression_time.count());
+  telemetry.count("leafs", num_leafs);
+  telemetry.count("stream bytes", stream.numBits() / CHAR_BIT);
+  recordTelemetry("encode.", telemetry);
+  for (int channel_num = 0; channel_num < compressors.size(); ++channel_num) {
+    recordTelemetry("encode.channel" + std::to_string(channel_num) + ".", compressors[channel_num].telemetry());
+  }
+}
+
+void compressImage(const Image& img, const std::string& filepath, int target_size_bytes, bool report_timings,
+                   bool subsample_chroma, bool entropy_coded, bool progressive, const Dictionary* dictionary,
+                   int block_profile) {
+  compressStream(img, filepath, target_size_bytes, report_timings, subsample_chroma, entropy_coded, progressive,
+                 nullptr, dictionary, block_profile);
+}
+
+SequenceEncoder::SequenceEncoder(bool subsample_chroma, bool entropy_coded, int block_profile)
+    : subsample_chroma_{subsample_chroma}, entropy_coded_{entropy_coded}, block_profile_{block_profile} { }
+
+void SequenceEncoder::compressFrame(const Image& img, const std::string& filepath, int target_size_bytes,
+                                    bool report_timings) {
+  compressStream(img, filepath, target_size_bytes, report_timings, subsample_chroma_, entropy_coded_, false, &state_,
+                 nullptr, block_profile_);
 }
@@ -1,90 +1,609 @@
 #include "decompressor.h"
 
+#include <algorithm>
+#include <barrier>
+#include <cmath>
+#include <numeric>
+#include <optional>
+#include <thread>
+
+#include "dictionary.h"
+#include "header.h"
 #include "interface.h"
 
-Decompressor::Decompressor(const Metadata& metadata) : metadata_{metadata} {
-  for (int level = kMinBlockLevel; level <= kMaxBlockLevel; ++level) {
+Decompressor::Decompressor(const Metadata& metadata, bool entropy_coded, bool inter,
+                           std::vector<std::vector<Translation>>* history, const HelperImage* domain)
+    : metadata_{metadata},
+      entropy_coded_{entropy_coded},
+      inter_{inter},
+      history_{history},
+      domain_{domain},
+      sz_{metadata.sz_},
+      band_height_{metadata.profile_.max_size_.first} {
+  for (int level = metadata.profile_.min_level_; level <= metadata.profile_.max_level_; ++level) {
     subblock_sizes_[level] = getBlockSize(level);
   }
 }
 
-void Decompressor::apply(Channel& dst, const Channel& src) const {
-  auto* dst_mem = dst.mem();
-  const auto* src_mem = src.mem();
-  for (const auto& tr : translations_) {
-    float b_mean = 0;
-    for (int h = 0; h < tr.sz_.first; ++h) {
-      for (int w = 0; w < tr.sz_.second; ++w) {
-        b_mean += src_mem[tr.b_mem_offset_ + h * metadata_.sz_.second + w];
+std::vector<int> Decompressor::helperWriters() const {
+  // every helper pixel is written by at most one translation
+  int hw = sz_.second / 2;
+  std::vector<int> writers(sz_.first / 2 * hw, -1);
+  for (int tr_num = 0; tr_num < translations_.size(); ++tr_num) {
+    const auto& tr = translations_[tr_num];
+    int ah = tr.a_mem_offset_ / sz_.second / 2;
+    int aw = tr.a_mem_offset_ % sz_.second / 2;
+    for (int h = ah; h < ah + tr.sz_.first / 2; ++h) {
+      for (int w = aw; w < aw + tr.sz_.second / 2; ++w) {
+        writers[h * hw + w] = tr_num;
+      }
+    }
+  }
+  return writers;
+}
+
+std::vector<int> Decompressor::producers(const std::vector<int>& writers, int tr_num) const {
+  int hh = sz_.first / 2;
+  int hw = sz_.second / 2;
+  const auto& tr = translations_[tr_num];
+  int bh = tr.b_mem_offset_ / sz_.second;
+  int bw = tr.b_mem_offset_ % sz_.second;
+  std::vector<int> result;
+  for (int h = bh; h < bh + tr.sz_.first; ++h) {
+    for (int w = bw; w < bw + tr.sz_.second; ++w) {
+      int p = writers[h % hh * hw + w % hw];
+      if (p != -1 && (result.empty() || result.back() != p)) {
+        result.push_back(p);
+      }
+    }
+  }
+  return result;
+}
+
+void Decompressor::restrictToRegion(Offset ofs, Size sz) {
+  assertWithMessage(ofs.first >= 0 && ofs.second >= 0 && ofs.first + sz.first <= sz_.first &&
+                        ofs.second + sz.second <= sz_.second,
+                    "region of interest should lie inside the image");
+  // the closure is a fixed point: every kept translation has its producers kept, so applying only these translations
+  // gives the same values inside the closure as applying all of them. Dictionary translations have no producers
+  auto writers = helperWriters();
+  std::vector<bool> needed(translations_.size(), false);
+  std::vector<int> queue;
+  for (int tr_num = 0; tr_num < translations_.size(); ++tr_num) {
+    const auto& tr = translations_[tr_num];
+    int ah = tr.a_mem_offset_ / sz_.second;
+    int aw = tr.a_mem_offset_ % sz_.second;
+    if (ah < ofs.first + sz.first && ofs.first < ah + tr.sz_.first && aw < ofs.second + sz.second &&
+        ofs.second < aw + tr.sz_.second) {
+      needed[tr_num] = true;
+      queue.push_back(tr_num);
+    }
+  }
+  while (!queue.empty() && domain_ == nullptr) {
+    int tr_num = queue.back();
+    queue.pop_back();
+    for (int p : producers(writers, tr_num)) {
+      if (!needed[p]) {
+        needed[p] = true;
+        queue.push_back(p);
       }
     }
-    b_mean /= tr.sz_.first * tr.sz_.second;
-    for (int h = 0; h < tr.sz_.first; ++h) {
-      for (int w = 0; w < tr.sz_.second; ++w) {
-        dst_mem[tr.a_mem_offset_ + h * metadata_.sz_.second + w] =
-            tr.brightness_ + src_mem[tr.b_mem_offset_ + h * metadata_.sz_.second + w] - b_mean;
+  }
+  std::vector<Translation> kept;
+  for (int tr_num = 0; tr_num < translations_.size(); ++tr_num) {
+    if (needed[tr_num]) {
+      kept.push_back(translations_[tr_num]);
+    }
+  }
+  translations_ = std::move(kept);
+}
+
+void Decompressor::buildInPlaceOrder() {
+  // translations are put in depth-first post-order of "reads helper written by" graph, so producers precede their
+  // consumers everywhere except on cycles
+  auto writers = helperWriters();
+  enum class State { kNew, kOnStack, kDone };
+  std::vector<State> state(translations_.size(), State::kNew);
+  std::vector<std::pair<int, std::vector<int>>> stack;
+  in_place_order_.clear();
+  in_place_order_.reserve(translations_.size());
+  for (int root = 0; root < translations_.size(); ++root) {
+    if (state[root] != State::kNew) {
+      continue;
+    }
+    state[root] = State::kOnStack;
+    stack.emplace_back(root, producers(writers, root));
+    while (!stack.empty()) {
+      auto& [tr_num, deps] = stack.back();
+      if (deps.empty()) {
+        state[tr_num] = State::kDone;
+        in_place_order_.push_back(tr_num);
+        stack.pop_back();
+        continue;
+      }
+      int dep = deps.back();
+      deps.pop_back();
+      if (state[dep] == State::kNew) {
+        state[dep] = State::kOnStack;
+        stack.emplace_back(dep, producers(writers, dep));
       }
     }
   }
 }
 
-Channel Decompressor::decompress(RStream& stream) {
-  deserializeNodes(stream);
-  Channel result = restore();
+void Decompressor::scaleTranslations(int scale) {
+  assertWithMessage(scale >= 1 && scale <= kMaxScale && isPowerOfTwo(scale), "scale should be a power of two up to 8");
+  sz_ = {metadata_.sz_.first / scale, metadata_.sz_.second / scale};
+  band_height_ = metadata_.profile_.max_size_.first / scale;
+  if (scale == 1) {
+    return;
+  }
+  int area = scale * scale;
+  std::vector<float> constants(sz_.first * sz_.second, 0);
+  std::vector<bool> is_constant(constants.size(), false);
+  std::vector<Translation> scaled;
+  // apply kernels exist down to the smallest block of any profile
+  constexpr Size kMinKernelSize = getBlockSize(kMinSupportedLevel);
+  for (const auto& tr : translations_) {
+    int ah = tr.a_mem_offset_ / metadata_.sz_.second;
+    int aw = tr.a_mem_offset_ % metadata_.sz_.second;
+    Size sz{tr.sz_.first / scale, tr.sz_.second / scale};
+    if (sz.first >= kMinKernelSize.first && sz.second >= kMinKernelSize.second) {
+      int bh = tr.b_mem_offset_ / metadata_.sz_.second;
+      int bw = tr.b_mem_offset_ % metadata_.sz_.second;
+      scaled.push_back(Translation{ah / scale * sz_.second + aw / scale, bh / scale * sz_.second + bw / scale,
+                                   tr.brightness_, getBlockLevel(sz), sz});
+      continue;
+    }
+    // leafs are aligned to their sizes, so every canvas pixel either lies inside a leaf or is covered by whole leafs
+    int ph = std::max(tr.sz_.first / scale, 1);
+    int pw = std::max(tr.sz_.second / scale, 1);
+    float value = static_cast<float>(tr.brightness_) * std::min(tr.sz_.first, scale) * std::min(tr.sz_.second, scale) /
+                  area;
+    for (int h = ah / scale; h < ah / scale + ph; ++h) {
+      for (int w = aw / scale; w < aw / scale + pw; ++w) {
+        constants[h * sz_.second + w] += value;
+        is_constant[h * sz_.second + w] = true;
+      }
+    }
+  }
+  translations_ = std::move(scaled);
+  constants_.clear();
+  for (int i = 0; i < constants.size(); ++i) {
+    if (is_constant[i]) {
+      constants_.emplace_back(i, constants[i]);
+    }
+  }
+}
+
+void Decompressor::fillConstants(Channel& result) const {
+  for (auto [mem_offset, value] : constants_) {
+    result.mem()[mem_offset] = value;
+  }
+}
+
+Channel Decompressor::decompress(const RStream& stream, const std::vector<int>& chunk_offsets, int rows_per_chunk,
+                                 const RestoreParams& params) {
+  deserializeNodes(stream, chunk_offsets, rows_per_chunk, params.num_threads);
+  return decompress(params);
+}
+
+Channel Decompressor::decompress(const RestoreParams& params) {
+  for (const auto& node : frontier_) {
+    translations_.push_back(node.translation_);
+  }
+  frontier_.clear();
+  scaleTranslations(params.scale);
+  bool roi = params.roi_size.first > 0 && params.roi_size.second > 0;
+  if (roi) {
+    restrictToRegion(params.roi_offset, params.roi_size);
+  }
+  buildBuckets();
+  if (params.in_place) {
+    buildInPlaceOrder();
+  }
+  Channel result = restore(params);
+  if (roi) {
+    return result.crop(params.roi_offset, params.roi_size);
+  }
 
   return std::move(result);
 }
 
-Channel Decompressor::restore(int number_applies) const {
-  auto start = std::chrono::high_resolution_clock::now();
-  Channel tmp{metadata_.sz_, true};
-  Channel result{metadata_.sz_};
-  for (int i = 0; i < number_applies; ++i) {
-    apply(result, tmp);
-    result.downsampleTo(tmp);
+Channel Decompressor::restore(const RestoreParams& params) const {
+  ScopedStage stage{telemetry_, "restore"};
+  Channel result{sz_, true};
+  fillConstants(result);
+  num_applies_ = 0;
+  if (domain_ != nullptr) {
+    // sources do not depend on the result, so one apply reaches the fixed point
+    apply(result, *domain_);
+    num_applies_ = 1;
+  } else if (params.in_place) {
+    restoreInPlace(params, result);
+  } else if (params.fused && !params.sat_means) {
+    restoreFused(params, result);
+  } else {
+    restoreTiled(params, result);
   }
-  auto end = std::chrono::high_resolution_clock::now();
-  restore_time_ = std::chrono::duration<double>(end - start);
+  telemetry_.count("restore iterations", num_applies_);
+  telemetry_.count("restored translations", translations_.size());
   return result;
 }
 
+void Decompressor::restoreInPlace(const RestoreParams& params, Channel& result) const {
+  HelperImage helper{sz_, false};
+  if (!constants_.empty()) {
+    helper.downsampleRows(result, 0, sz_.first);
+  }
+  while (num_applies_ < params.max_applies) {
+    TraceSpan span{"restore iteration", num_applies_};
+    ++num_applies_;
+    Delta delta = applyInPlace(result, helper.channel());
+    if (delta.max_ < params.max_delta || delta.sum_ / result.numel() < params.mean_delta) {
+      break;
+    }
+  }
+}
+
+void Decompressor::restoreTiled(const RestoreParams& params, Channel& result) const {
+  HelperImage helper{sz_, params.sat_means};
+  if (!constants_.empty()) {
+    helper.downsampleRows(result, 0, sz_.first);
+    helper.accumulateColumns(0, helper.numSatColumns());
+  }
+  // every thread owns a range of maximum blocks rows: it applies translations writing them and downsamples them,
+  // then a range of summed area table columns. Per row deltas are combined in the same order by every thread, so the
+  // result does not depend on threads number
+  int num_bands = band_buckets_.size();
+  int num_threads = std::clamp(params.num_threads, 1, num_bands);
+  std::vector<Delta> band_deltas(num_bands);
+  std::barrier sync{num_threads};
+  auto worker = [&](int thread_num) {
+    int begin_band = thread_num * num_bands / num_threads;
+    int end_band = (thread_num + 1) * num_bands / num_threads;
+    int begin_col = thread_num * helper.numSatColumns() / num_threads;
+    int end_col = (thread_num + 1) * helper.numSatColumns() / num_threads;
+    int num_applies = 0;
+    while (num_applies < params.max_applies) {
+      // spans end before the barrier, so gaps between them on the timeline are waits for other threads
+      {
+        TraceSpan span{"restore iteration", num_applies};
+        for (int band = begin_band; band < end_band; ++band) {
+          band_deltas[band] = applyBand(band, result, helper);
+        }
+      }
+      ++num_applies;
+      sync.arrive_and_wait();
+      Delta delta;
+      for (const auto& band_delta : band_deltas) {
+        delta.add(band_delta);
+      }
+      if (delta.max_ < params.max_delta || delta.sum_ / result.numel() < params.mean_delta) {
+        break;
+      }
+      helper.downsampleRows(result, begin_band * band_height_, end_band * band_height_);
+      sync.arrive_and_wait();
+      if (helper.sat()) {
+        helper.accumulateColumns(begin_col, end_col);
+        sync.arrive_and_wait();
+      }
+    }
+    if (thread_num == 0) {
+      num_applies_ = num_applies;
+    }
+  };
+  std::vector<std::jthread> threads;
+  for (int thread_num = 1; thread_num < num_threads; ++thread_num) {
+    threads.emplace_back(worker, thread_num);
+  }
+  worker(0);
+}
+
+void Decompressor::restoreFused(const RestoreParams& params, Channel& result) const {
+  // an iteration reads one quarter size helper and writes the other, so it makes a single pass over memory. The full
+  // size channel is written once, by the last apply
+  Size helper_sz{sz_.first / 2, sz_.second / 2};
+  Channel helpers[2] = {Channel{helper_sz, true}, Channel{helper_sz, true}};
+  // translations never write helper pixels of constant canvas pixels
+  if (!constants_.empty()) {
+    for (int h = 0; h < helper_sz.first; ++h) {
+      for (int w = 0; w < helper_sz.second; ++w) {
+        helpers[0].get(h, w) = helpers[1].get(h, w) = (result.get(h * 2, w * 2) + result.get(h * 2, w * 2 + 1) +
+                                                       result.get(h * 2 + 1, w * 2) + result.get(h * 2 + 1, w * 2 + 1)) /
+                                                      4 * kAlpha;
+      }
+    }
+  }
+  int num_bands = band_buckets_.size();
+  int num_threads = std::clamp(params.num_threads, 1, num_bands);
+  // deltas alternate between two arrays, so a thread starting the next iteration does not overwrite ones the others
+  // are still reading
+  std::vector<Delta> band_deltas[2] = {std::vector<Delta>(num_bands), std::vector<Delta>(num_bands)};
+  std::barrier sync{num_threads};
+  auto worker = [&](int thread_num) {
+    int begin_band = thread_num * num_bands / num_threads;
+    int end_band = (thread_num + 1) * num_bands / num_threads;
+    int cur = 0;
+    int num_applies = 0;
+    while (num_applies + 1 < params.max_applies) {
+      {
+        TraceSpan span{"restore iteration", num_applies};
+        for (int band = begin_band; band < end_band; ++band) {
+          band_deltas[cur][band] = fuseBand(band, helpers[cur ^ 1], helpers[cur]);
+        }
+      }
+      ++num_applies;
+      sync.arrive_and_wait();
+      Delta delta;
+      for (const auto& band_delta : band_deltas[cur]) {
+        delta.add(band_delta);
+      }
+      cur ^= 1;
+      // a pixel minus its block mean changes at most twice as much as the helper it is read from
+      if (delta.max_ * 2 < params.max_delta || delta.sum_ * 2 / helpers[0].numel() < params.mean_delta) {
+        break;
+      }
+    }
+    if (params.max_applies > 0) {
+      for (int band = begin_band; band < end_band; ++band) {
+        applyBand(band, result, helpers[cur]);
+      }
+      ++num_applies;
+    }
+    if (thread_num == 0) {
+      num_applies_ = num_applies;
+    }
+  };
+  std::vector<std::jthread> threads;
+  for (int thread_num = 1; thread_num < num_threads; ++thread_num) {
+    threads.emplace_back(worker, thread_num);
+  }
+  worker(0);
+}
+
 void Decompressor::reportTimings() const {
-  std::cout << "total channel decompression time: " << deserialization_time_.count() + restore_time_.count() << std::endl;
-  std::cout << "deserialization time: " << deserialization_time_.count() << std::endl;
-  std::cout << "restore time: " << restore_time_.count() << std::endl;
+  const auto& t = telemetry_;
+  std::cout << "total channel decompression time: " << t.seconds("deserialization") + t.seconds("restore") << std::endl;
+  std::cout << "deserialization time: " << t.seconds("deserialization") << std::endl;
+  std::cout << "restore time: " << t.seconds("restore") << std::endl;
+  std::cout << "restore iterations: " << num_applies_ << std::endl;
+  std::cout << "restored translations: " << translations_.size() << std::endl;
 }
 
-Image decompressImage(const std::string& filepath, bool report_timings) {
-  auto start = std::chrono::high_resolution_clock::now();
-  RStream stream{filepath};
-  int h = stream.extract(kBitsPerShape);
-  int w = stream.extract(kBitsPerShape);
-  int nc = stream.extract(kBitsForNumChannels);
-
-  Metadata metadata{{h, w}};
-  std::vector<std::pair<int, int>> ranges;
-  for (int channel_num = 0; channel_num < nc; ++channel_num) {
-    std::pair<int, int> range;
-    range.first = stream.extract(kRangeOffset) - kBitRange;
-    range.second = stream.extract(kRangeOffset) - kBitRange;
-    ranges.push_back(range);
+// inter frames decode only right after the previous frame of their sequence
+static bool hasHistory(const StreamHeader& header, const FrameHistory* history) {
+  if (!header.inter_) {
+    return true;
   }
-  std::vector<Channel> decompressed_channels;
-  for (int channel_num = 0; channel_num < nc; ++channel_num) {
-    Decompressor decomp{metadata};
-    auto chnl = decomp.decompress(stream);
-    chnl.denormalize(ranges[channel_num]);
-    decompressed_channels.emplace_back(std::move(chnl));
+  if (history == nullptr || history->channels_.size() != header.num_channels_) {
+    return false;
+  }
+  for (int channel_num = 0; channel_num < header.num_channels_; ++channel_num) {
+    Size sz = header.channelSize(channel_num);
+    Size max_block_size = kBlockProfiles[header.block_profile_].max_size_;
+    int num_blocks = sz.first / max_block_size.first * (sz.second / max_block_size.second);
+    if (history->channels_[channel_num].size() != num_blocks) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// decodes all channels following the header, returns maximum number of iterations channels took. history is the
+// one of the previous frame of a sequence, replaced by this frame's one. Channels' telemetry is recorded under
+// telemetry_prefix
+static int decompressChannels(const RStream& stream, const StreamHeader& header, const RestoreParams& params,
+                              bool report_timings, std::vector<Channel>& decompressed_channels,
+                              FrameHistory* history, const std::string& telemetry_prefix) {
+  Metadata metadata{header.sz_, header.block_profile_};
+  std::optional<Metadata> chroma_metadata;
+  // half resolution chroma decodes the halved region of interest
+  auto chroma_params = params;
+  if (header.subsample_chroma_) {
+    chroma_metadata.emplace(header.channelSize(1), header.block_profile_);
+    chroma_params.roi_offset = {params.roi_offset.first / 2, params.roi_offset.second / 2};
+    chroma_params.roi_size = {params.roi_size.first / 2, params.roi_size.second / 2};
+  }
+  // every channel reads its own chunks at the offsets recorded in the header
+  std::vector<Decompressor> decompressors;
+  decompressors.reserve(header.num_channels_);
+  std::vector<std::optional<Channel>> channels(header.num_channels_);
+  auto decompressChannel = [&](int channel_num) {
+    TraceSpan span{"decode channel", channel_num};
+    const auto& channel_params = channel_num > 0 && chroma_metadata ? chroma_params : params;
+    auto& decomp = decompressors[channel_num];
+    channels[channel_num].emplace(header.progressive_
+                                      ? decomp.decompress(channel_params)
+                                      : decomp.decompress(stream, header.chunk_offsets_[channel_num],
+                                                          header.rows_per_chunk_, channel_params));
+  };
+  // repeated translations get brightness of this frame's ranges. Progressive frames leave no translations by blocks,
+  // so a sequence can not continue from them
+  if (history != nullptr && header.inter_) {
+    for (int channel_num = 0; channel_num < header.num_channels_; ++channel_num) {
+      auto [from, to] = std::make_pair(history->ranges_[channel_num], header.ranges_[channel_num]);
+      for (auto& translations : history->channels_[channel_num]) {
+        for (auto& tr : translations) {
+          tr.brightness_ = renormalize(tr.brightness_, from, to);
+        }
+      }
+    }
+  }
+  if (history != nullptr) {
+    history->ranges_ = header.ranges_;
+    history->channels_.resize(header.progressive_ ? 0 : header.num_channels_);
+  }
+  for (int channel_num = 0; channel_num < header.num_channels_; ++channel_num) {
+    bool keeps_history = history != nullptr && !header.progressive_;
+    const HelperImage* domain =
+        header.dictionary_ ? params.dictionary->helper(channel_num, header.channelSize(channel_num)) : nullptr;
+    decompressors.emplace_back(channel_num > 0 && chroma_metadata ? *chroma_metadata : metadata, header.entropy_coded_,
+                               header.inter_, keeps_history ? &history->channels_[channel_num] : nullptr, domain);
+  }
+  // progressive body interleaves channels, so it is parsed serially up to its end before channels restore
+  if (header.progressive_) {
+    RStream body{stream};
+    bool complete = true;
+    for (auto& decomp : decompressors) {
+      complete = complete && decomp.deserializeBase(body);
+    }
+    for (int level = metadata.profile_.max_level_; level > metadata.profile_.min_level_ && complete; --level) {
+      for (auto& decomp : decompressors) {
+        complete = complete && decomp.deserializeRefinements(level, body);
+      }
+    }
+  }
+  if (params.parallel_channels) {
+    std::vector<std::jthread> threads;
+    for (int channel_num = 1; channel_num < header.num_channels_; ++channel_num) {
+      threads.emplace_back(decompressChannel, channel_num);
+    }
+    decompressChannel(0);
+  } else {
+    for (int channel_num = 0; channel_num < header.num_channels_; ++channel_num) {
+      decompressChannel(channel_num);
+    }
+  }
+
+  int num_applies = 0;
+  for (int channel_num = 0; channel_num < header.num_channels_; ++channel_num) {
+    const auto& decomp = decompressors[channel_num];
+    num_applies = std::max(num_applies, decomp.numApplies());
+    decompressed_channels.emplace_back(std::move(*channels[channel_num]));
     if (report_timings) {
       std::cout << "channel " << std::to_string(channel_num) << ":\n";
       decomp.reportTimings();
     }
+    recordTelemetry(telemetry_prefix + "channel" + std::to_string(channel_num) + ".", decomp.telemetry());
+  }
+  return num_applies;
+}
+
+int recommendNumApplies(std::vector<char> data, FrameHistory* history) {
+  RStream stream{std::move(data)};
+  auto header = StreamHeader::read(stream);
+  assertWithMessage(header.has_value(), "unsupported stream format");
+  assertWithMessage(hasHistory(*header, history), "inter frame needs the previous frame of its sequence");
+  if (header->dictionary_) {
+    return 1;
+  }
+  std::vector<Channel> channels;
+  return decompressChannels(stream, *header, RestoreParams{}, false, channels, history, "encode.applies.");
+}
+
+// streams that can not be decoded give an empty 0x0 image
+static Image emptyImage() {
+  std::vector<Channel> empty;
+  empty.emplace_back(Size{0, 0});
+  return Image{empty};
+}
+
+// whether the region of interest of params, if any, can be cropped from every channel of the scaled canvas
+static bool validRegion(const StreamHeader& header, const RestoreParams& params) {
+  auto [ofs, sz] = std::make_pair(params.roi_offset, params.roi_size);
+  if (params.scale < 1 || params.scale > kMaxScale || !isPowerOfTwo(params.scale)) {
+    return false;
+  }
+  if (sz.first <= 0 || sz.second <= 0) {
+    return true;
   }
+  Size canvas{header.sz_.first / params.scale, header.sz_.second / params.scale};
+  bool inside = ofs.first >= 0 && ofs.second >= 0 && ofs.first + sz.first <= canvas.first &&
+                ofs.second + sz.second <= canvas.second;
+  // half resolution chroma decodes the halved region
+  bool aligned = !header.subsample_chroma_ ||
+                 ofs.first % 2 == 0 && ofs.second % 2 == 0 && sz.first % 2 == 0 && sz.second % 2 == 0;
+  return inside && aligned;
+}
+
+static Image decompressStream(RStream stream, bool report_timings, const RestoreParams& params,
+                              std::chrono::high_resolution_clock::time_point start,
+                              FrameHistory* history = nullptr) {
+  auto header = StreamHeader::read(stream);
+  bool has_dictionary = header && (!header->dictionary_ || params.dictionary != nullptr &&
+                                                               params.dictionary->id() == header->dictionary_id_);
+  bool decodable = header && hasHistory(*header, history) && has_dictionary;
+  if (!decodable) {
+    assertWithMessage(false, !header           ? "unsupported stream format"
+                             : !has_dictionary ? "stream needs the dictionary it was coded with"
+                                               : "inter frame needs the previous frame of its sequence");
+    return emptyImage();
+  }
+
+  auto channel_params = params;
+  if (params.use_recommended_applies) {
+    channel_params.max_applies = header->num_applies_;
+  }
+  if (header->dictionary_ && params.scale != 1) {
+    assertWithMessage(false, "dictionary streams decode at full scale");
+    channel_params.scale = 1;
+  }
+  if (!validRegion(*header, channel_params)) {
+    assertWithMessage(false, "scale should be a power of two up to 8, region of interest should lie inside the scaled "
+                             "image, aligned to 2 pixels for subsampled chroma");
+    return emptyImage();
+  }
+  std::vector<Channel> decompressed_channels;
+  decompressChannels(stream, *header, channel_params, report_timings, decompressed_channels, history, "decode.");
+  Image img{decompressed_channels, header->ranges_};
 
   auto end = std::chrono::high_resolution_clock::now();
   auto total_decompression_time = std::chrono::duration<double>(end - start);
   if (report_timings) {
     std::cout << "total decompression time: " << total_decompression_time.count() << "\n";
   }
-  return Image{decompressed_channels};
+  Telemetry telemetry;
+  telemetry.addStage("total", total_decompression_time.count());
+  telemetry.count("stream bytes", stream.numBits() / CHAR_BIT);
+  recordTelemetry("decode.", telemetry);
+  return img;
+}
+
+Image decompressImage(const std::string& filepath, bool report_timings, const RestoreParams& params) {
+  auto start = std::chrono::high_resolution_clock::now();
+  return decompressStream(RStream{filepath}, report_timings, params, start);
+}
+
+Image decompressImage(std::span<const std::byte> data, bool report_timings, const RestoreParams& params) {
+  auto start = std::chrono::high_resolution_clock::now();
+  return decompressStream(RStream{data}, report_timings, params, start);
+}
+
+Image SequenceDecoder::decompressFrame(const std::string& filepath, bool report_timings, const RestoreParams& params) {
+  auto start = std::chrono::high_resolution_clock::now();
+  return decompressStream(RStream{filepath}, report_timings, params, start, &history_);
+}
+
+bool printStreamInfo(const std::string& filepath) {
+  RStream stream{filepath};
+  auto header = StreamHeader::read(stream);
+  if (!header) {
+    std::cout << "unsupported stream format\n";
+    return false;
+  }
+  std::cout << "format version: " << kFormatVersion << "\n";
+  std::cout << "stream size: " << stream.numBits() / CHAR_BIT << "\n";
+  std::cout << "image size: " << header->sz_.first << "x" << header->sz_.second << "\n";
+  std::cout << "channels: " << header->num_channels_ << "\n";
+  std::cout << "chroma subsampling: " << header->subsample_chroma_ << "\n";
+  std::cout << "entropy coded: " << header->entropy_coded_ << "\n";
+  std::cout << "progressive: " << header->progressive_ << "\n";
+  std::cout << "inter frame: " << header->inter_ << "\n";
+  std::cout << "dictionary: " << (header->dictionary_ ? std::to_string(header->dictionary_id_) : "none") << "\n";
+  const auto& profile = kBlockProfiles[header->block_profile_];
+  std::cout << "block profile: " << kBlockProfileNames[header->block_profile_] << " (" << profile.min_size_.first << "x"
+            << profile.min_size_.second << " to " << profile.max_size_.first << "x" << profile.max_size_.second << ")\n";
+  std::cout << "recommended applies: " << header->num_applies_ << "\n";
+  std::cout << "data offset: " << stream.bitPos() / CHAR_BIT << "\n";
+  for (int channel_num = 0; channel_num < header->num_channels_; ++channel_num) {
+    auto [min, max] = header->ranges_[channel_num];
+    std::cout << "channel " << channel_num << ": range [" << min << ", " << max << "], chunks (offset:size)";
+    for (int chunk_num = 0; chunk_num < header->numChunks(channel_num); ++chunk_num) {
+      std::cout << " " << header->chunk_offsets_[channel_num][chunk_num] << ":"
+                << header->chunk_sizes_[channel_num][chunk_num];
+    }
+    std::cout << "\n";
+  }
+  return true;
 }
@@ -0,0 +1,53 @@
+#include "dictionary.h"
+
+#include <algorithm>
+
+// FNV-1a
+static uint32_t hashBytes(uint32_t hash, const unsigned char* data, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    hash = (hash ^ data[i]) * 16777619u;
+  }
+  return hash;
+}
+
+// helper with its summed area table, so that the single apply takes source means from it
+static HelperImage prepareHelper(Channel chl) {
+  chl.normalize();
+  HelperImage helper{chl.size()};
+  helper.downsampleRows(chl, 0, chl.height());
+  helper.accumulateColumns(0, helper.numSatColumns());
+  return helper;
+}
+
+Dictionary::Dictionary(const Image& img) : sz_{img.size()} {
+  int shape[3] = {sz_.first, sz_.second, img.numChannels()};
+  id_ = hashBytes(2166136261u, reinterpret_cast<const unsigned char*>(shape), sizeof(shape));
+  id_ = hashBytes(id_, img.mem(), static_cast<size_t>(img.numel()) * img.numChannels());
+
+  // chroma is subsampled by profiles whose doubled maximum block divides the image
+  bool chroma_subsampled =
+      img.numChannels() == 3 && std::any_of(std::begin(kBlockProfiles), std::end(kBlockProfiles), [&](const auto& p) {
+        return sz_.first % (p.max_size_.first * 2) == 0 && sz_.second % (p.max_size_.second * 2) == 0;
+      });
+  auto channels = img.extractChannels();
+  for (int channel_num = 0; channel_num < channels.size(); ++channel_num) {
+    if (channel_num > 0 && chroma_subsampled) {
+      chroma_helpers_.push_back(prepareHelper(channels[channel_num].subsample()));
+    }
+    helpers_.push_back(prepareHelper(std::move(channels[channel_num])));
+  }
+}
+
+const HelperImage* Dictionary::helper(int channel_num, Size sz) const {
+  if (channel_num >= helpers_.size()) {
+    return nullptr;
+  }
+  if (helpers_[channel_num].channel().size() == sz) {
+    return &helpers_[channel_num];
+  }
+  if (channel_num > 0 && channel_num - 1 < chroma_helpers_.size() &&
+      chroma_helpers_[channel_num - 1].channel().size() == sz) {
+    return &chroma_helpers_[channel_num - 1];
+  }
+  return nullptr;
+}
@@ -0,0 +1,105 @@
+#include "entropy.h"
+
+#include <bit>
+#include <cstdlib>
+
+LeafCoder::LeafCoder(Size sz, Size min_block_size, int bits_for_match_idx)
+    : bits_for_match_idx_{bits_for_match_idx},
+      width_{sz.second},
+      min_block_size_{min_block_size},
+      cells_(sz.first / min_block_size.first * (sz.second / min_block_size.second), -1),
+      cells_width_{sz.second / min_block_size.second} { }
+
+int LeafCoder::cellOf(int mem_offset) const {
+  return mem_offset / width_ / min_block_size_.first * cells_width_ + mem_offset % width_ / min_block_size_.second;
+}
+
+int LeafCoder::predictBrightness(int cell) const {
+  int row = cell / cells_width_;
+  int col = cell % cells_width_;
+  int left = col > 0 ? cells_[cell - 1] : -1;
+  int top = row > 0 ? cells_[cell - cells_width_] : -1;
+  int top_left = row > 0 && col > 0 ? cells_[cell - cells_width_ - 1] : -1;
+  if (left >= 0 && top >= 0 && top_left >= 0) {
+    return std::max(std::min(left, top), std::min(std::max(left, top), left + top - top_left));
+  }
+  if (left >= 0 && top >= 0) {
+    return (left + top + 1) / 2;
+  }
+  if (left >= 0 || top >= 0) {
+    return std::max(left, top);
+  }
+  return prev_brightness_;
+}
+
+void LeafCoder::storeBrightness(int level, int cell, int brightness) {
+  auto sz = getBlockSize(level);
+  int num_rows = sz.first / min_block_size_.first;
+  int num_cols = sz.second / min_block_size_.second;
+  for (int r = 0; r < num_rows; ++r) {
+    cells_[cell + r * cells_width_ + num_cols - 1] = brightness;
+  }
+  for (int c = 0; c < num_cols; ++c) {
+    cells_[cell + (num_rows - 1) * cells_width_ + c] = brightness;
+  }
+  prev_brightness_ = brightness;
+}
+
+void LeafCoder::encodeLeaf(RangeEncoder& enc, int level, int mem_offset, int brightness, int match) {
+  int cell = cellOf(mem_offset);
+  int diff = brightness - predictBrightness(cell);
+  storeBrightness(level, cell, brightness);
+  enc.encode(ctx_.zero_, diff != 0);
+  if (diff != 0) {
+    enc.encode(ctx_.sign_, diff < 0);
+    unsigned magnitude = std::abs(diff);
+    int length = std::bit_width(magnitude);
+    for (int i = 1; i < kBitDepth; ++i) {
+      enc.encode(ctx_.length_[i], length > i);
+      if (length == i) {
+        break;
+      }
+    }
+    // the top bit is implied by the length
+    for (int i = length - 2; i >= 0; --i) {
+      enc.encode(ctx_.mantissa_[length][i], (magnitude >> i) & 1);
+    }
+  }
+
+  int tree_bits = std::min(kMatchTreeBits, bits_for_match_idx_);
+  int direct_bits = bits_for_match_idx_ - tree_bits;
+  int node = 1;
+  for (int i = tree_bits - 1; i >= 0; --i) {
+    int bit = (match >> (direct_bits + i)) & 1;
+    enc.encode(ctx_.match_tree_[level][node], bit);
+    node = node * 2 + bit;
+  }
+  enc.encodeDirect(match, direct_bits);
+}
+
+void LeafCoder::decodeLeaf(RangeDecoder& dec, int level, int mem_offset, int& brightness, int& match) {
+  int cell = cellOf(mem_offset);
+  int diff = 0;
+  if (dec.decode(ctx_.zero_)) {
+    bool negative = dec.decode(ctx_.sign_);
+    int length = 1;
+    while (length < kBitDepth && dec.decode(ctx_.length_[length])) {
+      ++length;
+    }
+    int magnitude = 1;
+    for (int i = length - 2; i >= 0; --i) {
+      magnitude = magnitude * 2 + dec.decode(ctx_.mantissa_[length][i]);
+    }
+    diff = negative ? -magnitude : magnitude;
+  }
+  brightness = predictBrightness(cell) + diff;
+  storeBrightness(level, cell, brightness);
+
+  int tree_bits = std::min(kMatchTreeBits, bits_for_match_idx_);
+  int direct_bits = bits_for_match_idx_ - tree_bits;
+  int node = 1;
+  for (int i = 0; i < tree_bits; ++i) {
+    node = node * 2 + dec.decode(ctx_.match_tree_[level][node]);
+  }
+  match = (node - (1 << tree_bits)) << direct_bits | dec.decodeDirect(direct_bits);
+}
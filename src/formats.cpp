@@ -0,0 +1,253 @@
+#include "formats.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <vector>
+
+#include "image.h"
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb/stb_image.h"
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb/stb_image_write.h"
+
+PixelBuffer allocPixels(int n) {
+  return PixelBuffer{new unsigned char[n], [](unsigned char* ptr) { delete[] ptr; }};
+}
+
+namespace {
+
+enum class Format { kStb, kPnm, kY4m, kGray, kRgb };
+
+Format formatOf(const std::string& path) {
+  auto dot = path.rfind('.');
+  std::string ext = dot == std::string::npos ? std::string{} : path.substr(dot + 1);
+  std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return std::tolower(c); });
+  if (ext == "pgm" || ext == "ppm" || ext == "pnm") {
+    return Format::kPnm;
+  }
+  if (ext == "y4m") {
+    return Format::kY4m;
+  }
+  if (ext == "gray") {
+    return Format::kGray;
+  }
+  if (ext == "rgb") {
+    return Format::kRgb;
+  }
+  return Format::kStb;
+}
+
+unsigned char toByte(float x) { return std::clamp(x + 0.5f, 0.f, 255.f); }
+
+// size of raw pixels named <name>.<width>x<height>.<ext>, empty if the name does not tell it
+Size rawSize(const std::string& path) {
+  auto ext_dot = path.rfind('.');
+  auto dot = ext_dot == 0 || ext_dot == std::string::npos ? std::string::npos : path.rfind('.', ext_dot - 1);
+  int w = 0, h = 0;
+  if (dot == std::string::npos || std::sscanf(path.c_str() + dot + 1, "%dx%d", &w, &h) != 2) {
+    return {0, 0};
+  }
+  return {h, w};
+}
+
+// reads packed pixels straight into the returned buffer
+Pixels readPacked(std::istream& is, Size sz, int channels) {
+  std::streamsize n = sz.first * sz.second * channels;
+  Pixels px{sz, channels, allocPixels(n)};
+  is.read(reinterpret_cast<char*>(px.data_.get()), n);
+  if (is.gcount() != n) {
+    return {};
+  }
+  return px;
+}
+
+// next number of netpbm header skipping whitespace and comments
+int pnmNumber(std::istream& is) {
+  while (is) {
+    int c = is.peek();
+    if (c == '#') {
+      is.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+    } else if (std::isspace(c)) {
+      is.get();
+    } else {
+      break;
+    }
+  }
+  int x = 0;
+  is >> x;
+  return x;
+}
+
+Pixels readPnm(const std::string& path) {
+  std::ifstream ifs{path, std::ifstream::binary};
+  char magic[2] = {};
+  ifs.read(magic, 2);
+  int channels = magic[0] != 'P' ? 0 : magic[1] == '5' ? 1 : magic[1] == '6' ? 3 : 0;
+  int w = pnmNumber(ifs);
+  int h = pnmNumber(ifs);
+  int max_value = pnmNumber(ifs);
+  if (channels == 0 || !ifs || w <= 0 || h <= 0 || max_value != 255) {
+    return {};
+  }
+  // single whitespace separates the header from pixels
+  ifs.get();
+  return readPacked(ifs, {h, w}, channels);
+}
+
+void writePnm(const std::string& path, const unsigned char* data, Size sz, int channels) {
+  std::ofstream ofs{path, std::ofstream::binary};
+  ofs << (channels == 1 ? "P5" : "P6") << "\n" << sz.second << " " << sz.first << "\n255\n";
+  ofs.write(reinterpret_cast<const char*>(data), sz.first * sz.second * channels);
+}
+
+// the first frame. Mono frames are read as they are, 4:2:0 and 4:4:4 ones are converted to rgb with full range BT.601
+// as in JFIF, 4:2:0 chroma is upsampled bilinearly
+Pixels readY4m(const std::string& path) {
+  std::ifstream ifs{path, std::ifstream::binary};
+  std::string line;
+  std::getline(ifs, line);
+  std::istringstream header{line};
+  std::string token;
+  header >> token;
+  if (token != "YUV4MPEG2") {
+    return {};
+  }
+  int w = 0, h = 0;
+  std::string colorspace = "420";
+  while (header >> token) {
+    if (token[0] == 'W') {
+      w = std::atoi(token.c_str() + 1);
+    } else if (token[0] == 'H') {
+      h = std::atoi(token.c_str() + 1);
+    } else if (token[0] == 'C') {
+      colorspace = token.substr(1);
+    }
+  }
+  bool mono = colorspace.rfind("mono", 0) == 0;
+  bool subsampled = colorspace.rfind("420", 0) == 0;
+  bool full = colorspace.rfind("444", 0) == 0 && colorspace.size() == 3;
+  // frame header may carry parameters
+  std::getline(ifs, line);
+  if (line.rfind("FRAME", 0) != 0 || w <= 0 || h <= 0 || !(mono || subsampled || full) ||
+      (subsampled && (w % 2 != 0 || h % 2 != 0))) {
+    return {};
+  }
+  Size sz{h, w};
+  if (mono) {
+    return readPacked(ifs, sz, 1);
+  }
+
+  Size chroma_sz = subsampled ? Size{h / 2, w / 2} : sz;
+  int numel = h * w;
+  int chroma_numel = chroma_sz.first * chroma_sz.second;
+  std::vector<unsigned char> planes(numel + chroma_numel * 2);
+  ifs.read(reinterpret_cast<char*>(planes.data()), planes.size());
+  if (ifs.gcount() != planes.size()) {
+    return {};
+  }
+  Channel cb{chroma_sz}, cr{chroma_sz};
+  for (int i = 0; i < chroma_numel; ++i) {
+    cb.mem()[i] = planes[numel + i] - 128.f;
+    cr.mem()[i] = planes[numel + chroma_numel + i] - 128.f;
+  }
+  if (subsampled) {
+    cb = cb.upsample();
+    cr = cr.upsample();
+  }
+  Pixels px{sz, 3, allocPixels(numel * 3)};
+  for (int i = 0; i < numel; ++i) {
+    float y = planes[i];
+    float u = cb.mem()[i];
+    float v = cr.mem()[i];
+    px.data_[i * 3] = toByte(y + 1.402f * v);
+    px.data_[i * 3 + 1] = toByte(y - 0.344136f * u - 0.714136f * v);
+    px.data_[i * 3 + 2] = toByte(y + 1.772f * u);
+  }
+  return px;
+}
+
+void writeY4m(const std::string& path, const unsigned char* data, Size sz, int channels) {
+  std::ofstream ofs{path, std::ofstream::binary};
+  ofs << "YUV4MPEG2 W" << sz.second << " H" << sz.first << " F25:1 Ip A1:1 " << (channels == 1 ? "Cmono" : "C444")
+      << "\nFRAME\n";
+  int numel = sz.first * sz.second;
+  if (channels == 1) {
+    ofs.write(reinterpret_cast<const char*>(data), numel);
+    return;
+  }
+  std::vector<unsigned char> planes(numel * 3);
+  for (int i = 0; i < numel; ++i) {
+    float r = data[i * 3];
+    float g = data[i * 3 + 1];
+    float b = data[i * 3 + 2];
+    planes[i] = toByte(0.299f * r + 0.587f * g + 0.114f * b);
+    planes[numel + i] = toByte(128.f - 0.168736f * r - 0.331264f * g + 0.5f * b);
+    planes[numel * 2 + i] = toByte(128.f + 0.5f * r - 0.418688f * g - 0.081312f * b);
+  }
+  ofs.write(reinterpret_cast<const char*>(planes.data()), planes.size());
+}
+
+Pixels readRaw(const std::string& path, int channels) {
+  Size sz = rawSize(path);
+  if (sz.first <= 0 || sz.second <= 0) {
+    return {};
+  }
+  std::ifstream ifs{path, std::ifstream::binary};
+  return readPacked(ifs, sz, channels);
+}
+
+Pixels readStb(const std::string& path) {
+  Pixels px;
+  unsigned char* data = stbi_load(path.c_str(), &px.sz_.second, &px.sz_.first, &px.channels_, 0);
+  if (data == nullptr) {
+    return {};
+  }
+  // stb's buffer is kept instead of copied
+  px.data_ = PixelBuffer{data, [](unsigned char* ptr) { stbi_image_free(ptr); }};
+  return px;
+}
+
+}  // namespace
+
+Pixels readPixels(const std::string& path) {
+  switch (formatOf(path)) {
+    case Format::kPnm:
+      return readPnm(path);
+    case Format::kY4m:
+      return readY4m(path);
+    case Format::kGray:
+      return readRaw(path, 1);
+    case Format::kRgb:
+      return readRaw(path, 3);
+    case Format::kStb:
+      return readStb(path);
+  }
+  return {};
+}
+
+void writePixels(const std::string& path, const unsigned char* data, Size sz, int channels) {
+  switch (formatOf(path)) {
+    case Format::kPnm:
+      writePnm(path, data, sz, channels);
+      return;
+    case Format::kY4m:
+      writeY4m(path, data, sz, channels);
+      return;
+    case Format::kGray:
+    case Format::kRgb: {
+      assertWithMessage((formatOf(path) == Format::kGray) == (channels == 1), "raw extension mismatches channels");
+      std::ofstream ofs{path, std::ofstream::binary};
+      ofs.write(reinterpret_cast<const char*>(data), sz.first * sz.second * channels);
+      return;
+    }
+    case Format::kStb:
+      stbi_write_png(path.c_str(), sz.second, sz.first, channels, data, sz.second * channels);
+      return;
+  }
+}
@@ -0,0 +1,146 @@
+#include "header.h"
+
+#include <algorithm>
+#include <bit>
+
+constexpr int kNumAppliesBitPos = sizeof(kFormatMagic) * CHAR_BIT + kBitsForFormatVersion + kBitsPerShape * 2 +
+                                  kBitsForNumChannels + kBitsForChromaSubsampling + kBitsForEntropyCoding +
+                                  kBitsForProgressive + kBitsForInterFrame + kBitsForDictionary + kBitsForBlockProfile;
+
+void StreamHeader::write(WStream& stream, const std::vector<std::vector<std::vector<char>>>& chunks) {
+  chunk_sizes_.clear();
+  int max_size = 0;
+  for (const auto& channel_chunks : chunks) {
+    chunk_sizes_.emplace_back();
+    for (const auto& chunk : channel_chunks) {
+      chunk_sizes_.back().push_back(chunk.size());
+      max_size = std::max<int>(max_size, chunk.size());
+    }
+  }
+
+  for (char c : kFormatMagic) {
+    stream.dump(c, CHAR_BIT);
+  }
+  stream.dump(kFormatVersion, kBitsForFormatVersion);
+  stream.dump(sz_.first, kBitsPerShape);
+  stream.dump(sz_.second, kBitsPerShape);
+  stream.dump(num_channels_, kBitsForNumChannels);
+  stream.dump(subsample_chroma_, kBitsForChromaSubsampling);
+  stream.dump(entropy_coded_, kBitsForEntropyCoding);
+  stream.dump(progressive_, kBitsForProgressive);
+  stream.dump(inter_, kBitsForInterFrame);
+  stream.dump(dictionary_, kBitsForDictionary);
+  stream.dump(block_profile_, kBitsForBlockProfile);
+  stream.dump(num_applies_, kBitsForNumApplies);
+  if (dictionary_) {
+    stream.dump(dictionary_id_, kBitsForDictionaryId);
+  }
+  for (auto [min, max] : ranges_) {
+    stream.dump(min + kBitRange, kRangeOffset);
+    stream.dump(max + kBitRange, kRangeOffset);
+  }
+  if (!progressive_) {
+    if (entropy_coded_) {
+      stream.dump(rows_per_chunk_, kBitsForRowsPerChunk);
+    }
+    int size_width = std::bit_width(static_cast<unsigned>(max_size));
+    stream.dump(size_width, kBitsForChunkSizeWidth);
+    for (const auto& channel_sizes : chunk_sizes_) {
+      for (int size : channel_sizes) {
+        stream.dump(size, size_width);
+      }
+    }
+  }
+  stream.align();
+
+  for (const auto& channel_chunks : chunks) {
+    for (const auto& chunk : channel_chunks) {
+      for (char byte : chunk) {
+        stream.dump(static_cast<unsigned char>(byte), CHAR_BIT);
+      }
+    }
+  }
+}
+
+std::optional<StreamHeader> StreamHeader::read(RStream& stream) {
+  if (stream.numBits() < sizeof(kFormatMagic) * CHAR_BIT + kBitsForFormatVersion) {
+    return std::nullopt;
+  }
+  for (char c : kFormatMagic) {
+    if (static_cast<char>(stream.extract(CHAR_BIT)) != c) {
+      return std::nullopt;
+    }
+  }
+  if (stream.extract(kBitsForFormatVersion) != kFormatVersion) {
+    return std::nullopt;
+  }
+  StreamHeader header;
+  header.sz_.first = stream.extract(kBitsPerShape);
+  header.sz_.second = stream.extract(kBitsPerShape);
+  header.num_channels_ = stream.extract(kBitsForNumChannels);
+  header.subsample_chroma_ = stream.extract(kBitsForChromaSubsampling);
+  header.entropy_coded_ = stream.extract(kBitsForEntropyCoding);
+  header.progressive_ = stream.extract(kBitsForProgressive);
+  header.inter_ = stream.extract(kBitsForInterFrame);
+  header.dictionary_ = stream.extract(kBitsForDictionary);
+  header.block_profile_ = stream.extract(kBitsForBlockProfile);
+  if (header.block_profile_ >= kNumBlockProfiles) {
+    return std::nullopt;
+  }
+  header.num_applies_ = stream.extract(kBitsForNumApplies);
+  header.dictionary_id_ = header.dictionary_ ? stream.extract(kBitsForDictionaryId) : 0;
+  for (int channel_num = 0; channel_num < header.num_channels_; ++channel_num) {
+    std::pair<int, int> range;
+    range.first = stream.extract(kRangeOffset) - kBitRange;
+    range.second = stream.extract(kRangeOffset) - kBitRange;
+    header.ranges_.push_back(range);
+  }
+  header.rows_per_chunk_ = header.entropy_coded_ && !header.progressive_ ? stream.extract(kBitsForRowsPerChunk) : 1;
+  if (header.rows_per_chunk_ == 0) {
+    return std::nullopt;
+  }
+  int size_width = header.progressive_ ? 0 : stream.extract(kBitsForChunkSizeWidth);
+  for (int channel_num = 0; channel_num < header.num_channels_; ++channel_num) {
+    header.chunk_sizes_.emplace_back();
+    for (int chunk_num = 0; chunk_num < header.numChunks(channel_num); ++chunk_num) {
+      header.chunk_sizes_.back().push_back(stream.extract(size_width));
+    }
+  }
+  stream.align();
+
+  int offset = stream.bitPos() / CHAR_BIT;
+  for (const auto& channel_sizes : header.chunk_sizes_) {
+    header.chunk_offsets_.emplace_back();
+    for (int size : channel_sizes) {
+      header.chunk_offsets_.back().push_back(offset);
+      offset += size;
+    }
+  }
+  // truncated streams are rejected before any chunk is read
+  if (offset * CHAR_BIT > stream.numBits()) {
+    return std::nullopt;
+  }
+  return header;
+}
+
+void StreamHeader::patchNumApplies(WStream& stream, int num_applies) {
+  stream.patch(kNumAppliesBitPos, num_applies, kBitsForNumApplies);
+}
+
+int StreamHeader::numFieldBits() const {
+  return kNumAppliesBitPos + kBitsForNumApplies + (dictionary_ ? kBitsForDictionaryId : 0) +
+         num_channels_ * kRangeOffset * 2 + (progressive_ ? 0 : kBitsForChunkSizeWidth) +
+         (entropy_coded_ && !progressive_ ? kBitsForRowsPerChunk : 0);
+}
+
+Size StreamHeader::channelSize(int channel_num) const {
+  if (channel_num > 0 && subsample_chroma_) {
+    return {sz_.first / 2, sz_.second / 2};
+  }
+  return sz_;
+}
+
+int StreamHeader::numChunks(int channel_num) const {
+  int num_rows = channelSize(channel_num).first / kBlockProfiles[block_profile_].max_size_.first;
+  return progressive_ ? 0 : (num_rows + rows_per_chunk_ - 1) / rows_per_chunk_;
+}
@@ -0,0 +1,86 @@
+#include "decompressor.h"
+
+#include <cstring>
+
+HelperImage::HelperImage(Size sz, bool with_sat) : chl_{sz, true}, sat_sz_{satSize(sz)} {
+  if (with_sat) {
+    sat_.resize(static_cast<size_t>(sat_sz_.first) * sat_sz_.second, 0);
+  }
+}
+
+Size HelperImage::satSize(Size sz) {
+  return {std::min(sz.first, sz.first / 2 + kMaxSupportedBlockSize.first) + 1,
+          std::min(sz.second, sz.second / 2 + kMaxSupportedBlockSize.second) + 1};
+}
+
+int HelperImage::satOffset(Size sz, int mem_offset) {
+  return mem_offset / sz.second * satSize(sz).second + mem_offset % sz.second;
+}
+
+typedef double DVec __attribute__((vector_size(kVecBytes)));
+constexpr int kDVecNumel = kVecBytes / sizeof(double);
+static_assert(kDVecNumel == 4);
+
+// prefix sums of several rows at once, each of them is scanned by vectors, that hides latency of the additions chain
+template <int kNumRows>
+static void scanRows(const float* const* rows, double* const* sat_rows, int n) {
+  DVec zero{0};
+  DVec carry[kNumRows]{};
+  for (int w = 0; w < n; w += kDVecNumel) {
+    for (int r = 0; r < kNumRows; ++r) {
+      const float* row = rows[r] + w;
+      DVec x{row[0], row[1], row[2], row[3]};
+      x += __builtin_shufflevector(zero, x, 0, 4, 5, 6);
+      x += __builtin_shufflevector(zero, x, 0, 1, 4, 5);
+      x += carry[r];
+      carry[r] = __builtin_shufflevector(x, x, 3, 3, 3, 3);
+      std::memcpy(sat_rows[r] + w, &x, kVecBytes);
+    }
+  }
+}
+
+void HelperImage::downsampleRows(const Channel& chl, int begin_row, int end_row) {
+  chl.downsampleRowsTo(chl_, begin_row, end_row);
+  if (sat_.empty()) {
+    return;
+  }
+  // table row h + 1 holds prefix sums of helper row h; rows of the bottom copy are written by the same call
+  constexpr int kRowsAtOnce = 4;
+  int hh = chl_.height() / 2;
+  const float* rows[kRowsAtOnce];
+  double* sat_rows[kRowsAtOnce];
+  int num_rows = 0;
+  auto flush = [&] {
+    if (num_rows == kRowsAtOnce) {
+      scanRows<kRowsAtOnce>(rows, sat_rows, sat_sz_.second - 1);
+    } else {
+      for (int r = 0; r < num_rows; ++r) {
+        scanRows<1>(rows + r, sat_rows + r, sat_sz_.second - 1);
+      }
+    }
+    num_rows = 0;
+  };
+  for (int h0 = begin_row / 2; h0 < end_row / 2; ++h0) {
+    for (int h = h0; h < sat_sz_.first - 1; h += hh) {
+      rows[num_rows] = chl_.mem() + h * chl_.width();
+      sat_rows[num_rows] = sat_.data() + (h + 1) * sat_sz_.second + 1;
+      if (++num_rows == kRowsAtOnce) {
+        flush();
+      }
+    }
+  }
+  flush();
+}
+
+void HelperImage::accumulateColumns(int begin_col, int end_col) {
+  if (sat_.empty()) {
+    return;
+  }
+  for (int h = 1; h < sat_sz_.first; ++h) {
+    double* __restrict__ cur = sat_.data() + h * sat_sz_.second;
+    const double* __restrict__ prev = cur - sat_sz_.second;
+    for (int w = begin_col; w < end_col; ++w) {
+      cur[w] += prev[w];
+    }
+  }
+}
@@ -1,131 +1,376 @@
 #include "image.h"
 
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 
-#define STB_IMAGE_IMPLEMENTATION
-#include "stb/stb_image.h"
+namespace {
 
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "stb/stb_image_write.h"
+Vec lanesMin(Vec a, Vec b) { return a < b ? a : b; }
+Vec lanesMax(Vec a, Vec b) { return a > b ? a : b; }
+
+// loads up to kVecNumel floats, lanes past count repeat the last one so that they change no minimum or maximum
+Vec loadLanes(const float* mem, int count) {
+  if (count == kVecNumel) [[likely]] {
+    return loadVec(mem);
+  }
+  Vec v;
+  for (int j = 0; j < kVecNumel; ++j) {
+    v[j] = mem[std::min(j, count - 1)];
+  }
+  return v;
+}
+
+void storeLanes(float* mem, Vec v, int count) {
+  if (count == kVecNumel) [[likely]] {
+    storeVec(mem, v);
+    return;
+  }
+  for (int j = 0; j < count; ++j) {
+    mem[j] = v[j];
+  }
+}
+
+// lanes of 8 bytes in the low half of v
+Vec toLanes(__m128i v) { return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(v)); }
+
+// 8 bytes in the low half, lanes should be within [0, 255]
+__m128i toBytes(Vec v) {
+  __m256i ints = _mm256_cvttps_epi32(v);
+  __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(ints), _mm256_extracti128_si256(ints, 1));
+  return _mm_packus_epi16(words, words);
+}
+
+static_assert(kVecNumel == 8, "pixel shuffles are written for 8 lanes");
+
+// deinterleaves kVecNumel pixels into yuv (or gray) lanes with byte shuffles
+template <int kChannels>
+void loadPixels(const unsigned char* px, Vec (&out)[kChannels]) {
+  if constexpr (kChannels == 1) {
+    out[0] = toLanes(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(px)));
+  } else {
+    // 24 bytes of 8 pixels are gathered into r and g halves of one register and b of another
+    __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(px));
+    __m128i hi = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(px + 16));
+    __m128i rg = _mm_or_si128(
+        _mm_shuffle_epi8(lo, _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1)),
+        _mm_shuffle_epi8(hi, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, -1, -1, -1, -1, -1, 0, 3, 6)));
+    __m128i b = _mm_or_si128(
+        _mm_shuffle_epi8(lo, _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+        _mm_shuffle_epi8(hi, _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, -1, -1, -1, -1, -1, -1, -1, -1)));
+    Vec r_lanes = toLanes(rg);
+    Vec g_lanes = toLanes(_mm_srli_si128(rg, 8));
+    Vec b_lanes = toLanes(b);
+    out[0] = 0.299f * r_lanes + 0.587f * g_lanes + 0.114f * b_lanes;
+    out[1] = -0.14714119f * r_lanes - 0.28886916f * g_lanes + 0.43601035f * b_lanes;
+    out[2] = 0.61497538f * r_lanes - 0.51496512f * g_lanes - 0.10001026f * b_lanes;
+  }
+}
+
+// clamps lanes to bytes and interleaves count pixels of them
+template <int kChannels>
+void storePixels(unsigned char* px, int count, const Vec (&in)[kChannels]) {
+  __m128i c[kChannels];
+  for (int k = 0; k < kChannels; ++k) {
+    c[k] = toBytes(lanesMin(lanesMax(in[k], Vec{}), Vec{} + 255.f));
+  }
+  alignas(16) unsigned char bytes[32];
+  if constexpr (kChannels == 1) {
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(bytes), c[0]);
+  } else {
+    __m128i rg = _mm_unpacklo_epi64(c[0], c[1]);
+    __m128i lo = _mm_or_si128(
+        _mm_shuffle_epi8(rg, _mm_setr_epi8(0, 8, -1, 1, 9, -1, 2, 10, -1, 3, 11, -1, 4, 12, -1, 5)),
+        _mm_shuffle_epi8(c[2], _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1)));
+    __m128i hi = _mm_or_si128(
+        _mm_shuffle_epi8(rg, _mm_setr_epi8(13, -1, 6, 14, -1, 7, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+        _mm_shuffle_epi8(c[2], _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, -1, -1, -1, -1, -1, -1)));
+    _mm_store_si128(reinterpret_cast<__m128i*>(bytes), lo);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(bytes + 16), hi);
+  }
+  std::memcpy(px, bytes, count * kChannels);
+}
+
+// calls f(i, count, lanes) for every kVecNumel pixels starting at i. The last group may be shorter, its lanes past
+// count repeat its last pixel so that they change no minimum or maximum
+template <int kChannels, typename F>
+void forEachPixels(const unsigned char* px, int n, F f) {
+  int i = 0;
+  for (; i + kVecNumel <= n; i += kVecNumel) {
+    Vec v[kChannels];
+    loadPixels<kChannels>(px + i * kChannels, v);
+    f(i, kVecNumel, v);
+  }
+  if (i < n) {
+    unsigned char tail[kVecNumel * kChannels];
+    for (int j = 0; j < kVecNumel * kChannels; ++j) {
+      tail[j] = px[(i + std::min(j / kChannels, n - i - 1)) * kChannels + j % kChannels];
+    }
+    Vec v[kChannels];
+    loadPixels<kChannels>(tail, v);
+    f(i, n - i, v);
+  }
+}
+
+// minimum and maximum of every converted channel, without storing them
+template <int kChannels>
+std::vector<std::pair<float, float>> pixelsStats(const unsigned char* px, int n) {
+  Vec mins[kChannels], maxs[kChannels];
+  for (int k = 0; k < kChannels; ++k) {
+    mins[k] = Vec{} + kInf;
+    maxs[k] = Vec{} - kInf;
+  }
+  forEachPixels<kChannels>(px, n, [&](int i, int count, const Vec(&v)[kChannels]) {
+    for (int k = 0; k < kChannels; ++k) {
+      mins[k] = lanesMin(mins[k], v[k]);
+      maxs[k] = lanesMax(maxs[k], v[k]);
+    }
+  });
+  std::vector<std::pair<float, float>> stats;
+  for (int k = 0; k < kChannels; ++k) {
+    stats.emplace_back(-vecMax(-mins[k]), vecMax(maxs[k]));
+  }
+  return stats;
+}
+
+// converts pixels into channels in one pass, every value v of channel k becoming (v - offsets[k]) * muls[k]
+template <int kChannels>
+void convertPixels(const unsigned char* px, int n, std::vector<Channel>& channels, const float* offsets,
+                   const float* muls) {
+  float* dst[kChannels];
+  for (int k = 0; k < kChannels; ++k) {
+    dst[k] = channels[k].mem();
+  }
+  forEachPixels<kChannels>(px, n, [&](int i, int count, const Vec(&v)[kChannels]) {
+    for (int k = 0; k < kChannels; ++k) {
+      storeLanes(dst[k] + i, (v[k] - offsets[k]) * muls[k], count);
+    }
+  });
+}
+
+// denormalizes channels, converts them to rgb (or gray), clamps and interleaves the result in one pass
+template <int kChannels>
+void interleavePixels(const std::vector<const Channel*>& channels, int n, const float* muls, const float* offsets,
+                      unsigned char* px) {
+  const float* src[kChannels];
+  for (int k = 0; k < kChannels; ++k) {
+    src[k] = channels[k]->mem();
+  }
+  for (int i = 0; i < n; i += kVecNumel) {
+    int count = std::min(kVecNumel, n - i);
+    Vec c[kChannels];
+    for (int k = 0; k < kChannels; ++k) {
+      c[k] = loadLanes(src[k] + i, count) * muls[k] + offsets[k];
+    }
+    Vec out[kChannels];
+    if constexpr (kChannels == 1) {
+      out[0] = c[0] + 0.5f;
+    } else {
+      out[0] = c[0] + 1.13988303f * c[2];
+      out[1] = c[0] - 0.39464233f * c[1] - 0.58062185f * c[2];
+      out[2] = c[0] + 2.03206185f * c[1];
+    }
+    storePixels<kChannels>(px + i * kChannels, count, out);
+  }
+}
+
+}  // namespace
 
 std::pair<float, float> Channel::getStats() const {
-  float max = -kInf;
-  float min = kInf;
-  for (int i = 0; i < numel(); ++i) {
-    min = std::min<float>(min, mem()[i]);
-    max = std::max<float>(max, mem()[i]);
+  Vec mins = Vec{} + kInf;
+  Vec maxs = Vec{} - kInf;
+  for (int i = 0; i < numel(); i += kVecNumel) {
+    Vec v = loadLanes(mem() + i, std::min(kVecNumel, numel() - i));
+    mins = lanesMin(mins, v);
+    maxs = lanesMax(maxs, v);
   }
-  return {min, max};
+  return {-vecMax(-mins), vecMax(maxs)};
 }
 
-std::pair<int, int> Channel::normalize() {
-  auto stats = getStats();
+std::pair<int, int> Channel::rangeOf(std::pair<float, float> stats) {
   int min = stats.first;
   int max = std::max<int>(stats.second, min + 1);  // to avoid division by 0 if channel is plain
+  return {min, max};
+}
+
+std::pair<int, int> Channel::normalize() {
+  auto range = rangeOf(getStats());
+  normalize(range);
+  return range;
+}
+
+void Channel::normalize(std::pair<int, int> range) {
+  auto [min, max] = range;
   float mul = kBitRange / float(max - min);
-  for (int i = 0; i < numel(); ++i) {
-    mem()[i] = (mem()[i] - min) * mul;
+  for (int i = 0; i < numel(); i += kVecNumel) {
+    int count = std::min(kVecNumel, numel() - i);
+    storeLanes(mem() + i, (loadLanes(mem() + i, count) - float(min)) * mul, count);
   }
-  return {min, max};
 }
 
 void Channel::denormalize(std::pair<int, int> range) {
   auto [min, max] = range;
-  float mul = kBitRange / float(max - min);
-  for (int i = 0; i < numel(); ++i) {
-    mem()[i] = mem()[i] / mul + min;
+  float mul = (max - min) / float(kBitRange);
+  for (int i = 0; i < numel(); i += kVecNumel) {
+    int count = std::min(kVecNumel, numel() - i);
+    storeLanes(mem() + i, loadLanes(mem() + i, count) * mul + float(min), count);
   }
 }
 
+static unsigned char clamp(float x) { return std::min<float>(std::max<float>(0., x), 255.); }
+
 void Channel::save(const std::string& path) const {
-  auto tmp = new unsigned char[h_ * w_];
+  std::vector<unsigned char> tmp(h_ * w_);
   for (int i = 0; i < h_ * w_; ++i) {
-    tmp[i] = std::max<unsigned char>(std::min<unsigned char>(mem()[i], 255), 0);
+    tmp[i] = clamp(mem()[i] + 0.5);
   }
-  stbi_write_png(path.c_str(), w_, h_, 1, tmp, w_);
+  writePixels(path, tmp.data(), size(), 1);
 }
 
-static unsigned char clamp(float x) { return std::min<float>(std::max<float>(0., x), 255.); }
-
 Image::Image(const std::string& path) {
-  unsigned char* data = stbi_load(path.c_str(), &sz_.second, &sz_.first, &channels_, 0);
-  //printf("Loaded image with a width of %dpx, a height of %dpx and %d channels\n", sz_.second, sz_.first, channels_);
+  auto pixels = readPixels(path);
+  if (pixels.data_ == nullptr) {
+    assertWithMessage(false, "can't read image " + path);
+    sz_ = {0, 0};
+    channels_ = 0;
+    return;
+  }
+  sz_ = pixels.sz_;
+  channels_ = pixels.channels_;
+  data_ = std::move(pixels.data_);
   assertWithMessage(channels_ == 1 || channels_ == 3, "only grayscale or rgb images are supported");
-  data_ = std::make_unique<unsigned char[]>(numel() * channels_);
-  std::memcpy(mem(), data, numel() * channels_);
-  stbi_image_free(data);
 }
 
-Image::Image(const std::vector<Channel>& channels) {
+Image::Image(unsigned char* data, Size sz, int channels)
+    : sz_{sz}, channels_{channels}, data_{data, [](unsigned char*) { }} {
+  assertWithMessage(channels_ == 1 || channels_ == 3, "only grayscale or rgb images are supported");
+}
+
+Image::Image(const std::vector<Channel>& channels, const std::vector<std::pair<int, int>>& ranges) {
   channels_ = channels.size();
   assertWithMessage(channels_ == 1 || channels_ == 3, "only grayscale or rgb images are supported");
   sz_ = channels[0].size();
-  data_ = std::make_unique<unsigned char[]>(numel() * channels_);
+  data_ = allocPixels(numel() * channels_);
 
-  if (channels_ == 1) {
-    for (int i = 0; i < numel(); ++i) {
-      mem()[i] = clamp(channels[0].mem()[i] + 0.5);
-    }
-  } else if (channels_ == 3) {
-    for (int i = 0; i < numel(); ++i) {
-      float y = channels[0].mem()[i];
-      float u = channels[1].mem()[i];
-      float v = channels[2].mem()[i];
-      float r = 1 * y + 1.13988303 * v;
-      float g = 1 * y - 0.39464233 * u - 0.58062185 * v;
-      float b = 1 * y + 2.03206185 * u;
-      mem()[i * 3] = clamp(r);
-      mem()[i * 3 + 1] = clamp(g);
-      mem()[i * 3 + 2] = clamp(b);
+  // chroma may be coded at half resolution (4:2:0). Upsampling weights sum up to one, so it commutes with denormalizing
+  std::vector<Channel> upsampled;
+  std::vector<const Channel*> full_size{&channels[0]};
+  for (int i = 1; i < channels_; ++i) {
+    if (channels[i].size() != sz_) {
+      upsampled.emplace_back(channels[i].upsample());
+      assertWithMessage(upsampled.back().size() == sz_, "chroma shapes mismatch");
     }
   }
-}
+  for (int i = 1; i < channels_; ++i) {
+    full_size.push_back(upsampled.empty() ? &channels[i] : &upsampled[i - 1]);
+  }
 
-void Image::save(const std::string& path) {
-  stbi_write_png(path.c_str(), sz_.second, sz_.first, channels_, mem(), sz_.second * channels_);
+  float muls[3] = {1, 1, 1};
+  float offsets[3] = {0, 0, 0};
+  for (int i = 0; i < ranges.size(); ++i) {
+    muls[i] = (ranges[i].second - ranges[i].first) / float(kBitRange);
+    offsets[i] = ranges[i].first;
+  }
+  if (channels_ == 1) {
+    interleavePixels<1>(full_size, numel(), muls, offsets, mem());
+  } else {
+    interleavePixels<3>(full_size, numel(), muls, offsets, mem());
+  }
 }
 
+void Image::save(const std::string& path) const { writePixels(path, mem(), sz_, channels_); }
+
 std::vector<Channel> Image::extractChannels() const {
-  if (channels_ == 3) {
-    std::vector<Channel> yuv;
-    yuv.reserve(3);
-    for (int i = 0; i < 3; ++i) {
-      yuv.emplace_back(sz_);
-    }
-    for (int i = 0; i < numel(); ++i) {
-      float r = mem()[i * 3];
-      float g = mem()[i * 3 + 1];
-      float b = mem()[i * 3 + 2];
-      yuv[0].mem()[i] = 0.299 * r + 0.587 * g + 0.114 * b;
-      yuv[1].mem()[i] = -0.14714119 * r - 0.28886916 * g + 0.43601035 * b;
-      yuv[2].mem()[i] = 0.61497538 * r - 0.51496512 * g - 0.10001026 * b;
-    }
-    return std::move(yuv);
-  } else if (channels_ == 1) {
-    std::vector<Channel> ch;
-    ch.emplace_back(sz_);
-    for (int i = 0; i < numel(); ++i) {
-      ch[0].mem()[i] = mem()[i];
-    }
-    return ch;
+  std::vector<Channel> channels;
+  for (int i = 0; i < channels_; ++i) {
+    channels.emplace_back(sz_);
+  }
+  float muls[3] = {1, 1, 1};
+  float offsets[3] = {0, 0, 0};
+  if (channels_ == 1) {
+    convertPixels<1>(mem(), numel(), channels, offsets, muls);
+  } else {
+    convertPixels<3>(mem(), numel(), channels, offsets, muls);
+  }
+  return channels;
+}
+
+std::vector<std::pair<float, float>> Image::channelsStats() const {
+  return channels_ == 1 ? pixelsStats<1>(mem(), numel()) : pixelsStats<3>(mem(), numel());
+}
+
+std::vector<Channel> Image::extractNormalizedChannels(const std::vector<std::pair<int, int>>& ranges) const {
+  std::vector<Channel> channels;
+  float muls[3], offsets[3];
+  for (int i = 0; i < channels_; ++i) {
+    channels.emplace_back(sz_);
+    offsets[i] = ranges[i].first;
+    muls[i] = kBitRange / float(ranges[i].second - ranges[i].first);
+  }
+  if (channels_ == 1) {
+    convertPixels<1>(mem(), numel(), channels, offsets, muls);
+  } else {
+    convertPixels<3>(mem(), numel(), channels, offsets, muls);
   }
-  std::terminate();
+  return channels;
 }
 
-void Channel::downsampleTo(Channel& dst, float alpha) const {
+void Channel::downsampleTo(Channel& dst, float alpha) const { downsampleRowsTo(dst, 0, height(), alpha); }
+
+void Channel::downsampleRowsTo(Channel& dst, int begin_row, int end_row, float alpha) const {
   assertWithMessage(size() == dst.size(), "channels shape mismatch");
   assertWithMessage(size().first % 2 == 0 && size().second % 2 == 0, "channel shapes should be divisible by 2");
-  for (int h = 0; h < height() / 2; ++h) {
+  assertWithMessage(begin_row % 2 == 0 && end_row % 2 == 0, "rows range should be aligned by 2");
+  for (int h = begin_row / 2; h < end_row / 2; ++h) {
     for (int w = 0; w < width() / 2; ++w) {
       dst.get(h, w) =
           (get(h * 2, w * 2) + get(h * 2, w * 2 + 1) + get(h * 2 + 1, w * 2) + get(h * 2 + 1, w * 2 + 1)) / 4 * alpha;
     }
   }
 
-  for (int h = 0; h < height() / 2; ++h) {
+  for (int h = begin_row / 2; h < end_row / 2; ++h) {
     for (int w = 0; w < width() / 2; ++w) {
       dst.get(h, w + width() / 2) = dst.get(h + height() / 2, w) = dst.get(h + height() / 2, w + width() / 2) =
           dst.get(h, w);
     }
   }
 }
+
+Channel Channel::crop(Offset ofs, Size sz) const {
+  assertWithMessage(ofs.first >= 0 && ofs.second >= 0 && ofs.first + sz.first <= height() &&
+                        ofs.second + sz.second <= width(),
+                    "crop should lie inside the channel");
+  Channel dst{sz};
+  for (int h = 0; h < sz.first; ++h) {
+    std::memcpy(&dst.get(h, 0), &get(ofs.first + h, ofs.second), sz.second * sizeof(float));
+  }
+  return dst;
+}
+
+Channel Channel::subsample() const {
+  assertWithMessage(size().first % 2 == 0 && size().second % 2 == 0, "channel shapes should be divisible by 2");
+  Channel dst{Size{height() / 2, width() / 2}};
+  for (int h = 0; h < dst.height(); ++h) {
+    for (int w = 0; w < dst.width(); ++w) {
+      dst.get(h, w) = (get(h * 2, w * 2) + get(h * 2, w * 2 + 1) + get(h * 2 + 1, w * 2) + get(h * 2 + 1, w * 2 + 1)) / 4;
+    }
+  }
+  return dst;
+}
+
+Channel Channel::upsample() const {
+  // output pixel i lies at i / 2 - 0.25 in source coordinates, so each output pixel blends its source pixel (3 / 4)
+  // with the nearest neighbour on its side (1 / 4)
+  auto neighbour = [](int i, int n) { return std::clamp(i % 2 == 0 ? i / 2 - 1 : i / 2 + 1, 0, n - 1); };
+  Channel dst{Size{height() * 2, width() * 2}};
+  for (int h = 0; h < dst.height(); ++h) {
+    int h0 = h / 2;
+    int h1 = neighbour(h, height());
+    for (int w = 0; w < dst.width(); ++w) {
+      int w0 = w / 2;
+      int w1 = neighbour(w, width());
+      dst.get(h, w) = (9 * get(h0, w0) + 3 * get(h0, w1) + 3 * get(h1, w0) + get(h1, w1)) / 16;
+    }
+  }
+  return dst;
+}
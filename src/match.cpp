@@ -1,13 +1,23 @@
-#include <chrono>
+#include <algorithm>
 #include <iostream>
 
 #include "compressor.h"
+#include "kernels.h"
+#include "trace.h"
 
 // in this file group refers to a set of blocks of size VecNumel
 
+// "b" groups per span of the trace timeline
+constexpr int kTracedBGroups = 64;
+
 // transforms channel into groups of maximum blocks
+template <int kProfile>
 void reorder(Vec* __restrict__ group, const float* __restrict__ mem, Vec* __restrict__ mean, Vec* __restrict__ sumsq,
              const Pattern& pattern, const IVec& mem_offsets) {
+  constexpr int kMinBlocksInMax = kBlockProfiles[kProfile].min_blocks_in_max_;
+  constexpr int kMinBlockNumel = kBlockProfiles[kProfile].min_numel_;
+  constexpr Size kMinimumBlockSize = kBlockProfiles[kProfile].min_size_;
+  constexpr int kMinBlockLevel = kBlockProfiles[kProfile].min_level_;
   const auto& pt = pattern[kMinBlockLevel];
   int ptr = 0;
   for (int block_num = 0; block_num < kMinBlocksInMax; ++block_num) {
@@ -24,7 +34,7 @@ void reorder(Vec* __restrict__ group, const float* __restrict__ mem, Vec* __rest
         ++mbpos;
       }
     }
-    cmean /= kMinBlockNumel;
+    cmean /= static_cast<float>(kMinBlockNumel);
     mean[block_num] = cmean;
     Vec csumsq{0};
     for (int mbpos = 0; mbpos < kMinBlockNumel; ++mbpos) {
@@ -52,8 +62,11 @@ void reorder(Vec* __restrict__ group, const float* __restrict__ mem, Vec* __rest
 }
 
 // finds matches for minimal blocks
+template <int kProfile>
 void matchGroup(const Vec* __restrict__ a_group, const Vec* __restrict__ b_group, Vec* __restrict__ asumsq,
                 Vec* __restrict__ bsumsq, Vec* __restrict__ buf) {
+  constexpr int kMinBlocksInMax = kBlockProfiles[kProfile].min_blocks_in_max_;
+  constexpr int kMinBlockNumel = kBlockProfiles[kProfile].min_numel_;
   for (int block_num = 0; block_num < kMinBlocksInMax; ++block_num) {
     Vec tmp[kVecNumel]{0};
     for (int mbpos = 0; mbpos < kMinBlockNumel; ++mbpos) {
@@ -88,8 +101,11 @@ inline void updateGroup(const Vec* __restrict__ buf, Vec& __restrict__ errors, I
 }
 
 // finds best coverings for blocks for each layer by combining best coverings from prev layer
+template <int kProfile>
 void reduce(Vec* __restrict__ buf, Vec* __restrict__ errors, IVec* __restrict__ matches, const IVec update_matches,
             const Vec* __restrict__ a_mean, const Vec* __restrict__ b_mean) {
+  constexpr int kMinBlocksInMax = kBlockProfiles[kProfile].min_blocks_in_max_;
+  constexpr int kMinBlockNumel = kBlockProfiles[kProfile].min_numel_;
   int num_blocks = kMinBlocksInMax / 2;
   int cur_offset = 0;
   float mul = kMinBlockNumel / 2;
@@ -114,19 +130,23 @@ void reduce(Vec* __restrict__ buf, Vec* __restrict__ errors, IVec* __restrict__
   updateGroup(buf, errors[cur_offset], matches[cur_offset], update_matches);
 }
 
+template <int kProfile>
 void Compressor::matchBlocks() {
+  constexpr int kMaxBlockNumel = kBlockProfiles[kProfile].max_numel_;
+  constexpr int kMinBlocksInMax = kBlockProfiles[kProfile].min_blocks_in_max_;
   IVec mem_offsets{0};
   const float* __restrict__ a_mem = a_chl_.mem();
-  const float* __restrict__ b_mem = b_chl_.mem();
-  auto buf = allocVecs(kMinBlocksInMax * kVecNumel);
 
-  for (int vnum = 0; vnum < metadata_.num_a_groups_; ++vnum) {
-    IVec group_offsets;
-    for (int vpos = 0; vpos < kVecNumel; ++vpos) {
-      group_offsets[vpos] = metadata_.a_block_offsets_[vnum * kVecNumel + vpos];
+  {
+    ScopedStage stage{telemetry_, "reorder"};
+    for (int vnum = 0; vnum < metadata_.num_a_groups_; ++vnum) {
+      IVec group_offsets;
+      for (int vpos = 0; vpos < kVecNumel; ++vpos) {
+        group_offsets[vpos] = metadata_.a_block_offsets_[vnum * kVecNumel + vpos];
+      }
+      reorder<kProfile>(a_groups() + vnum * kMaxBlockNumel, a_mem, a_mean() + vnum * kMinBlocksInMax * 2,
+                        a_sumsq() + vnum * kMinBlocksInMax, metadata_.pt_, group_offsets);
     }
-    reorder(a_groups() + vnum * kMaxBlockNumel, a_mem, a_mean() + vnum * kMinBlocksInMax * 2,
-            a_sumsq() + vnum * kMinBlocksInMax, metadata_.pt_, group_offsets);
   }
   for (int i = 0; i < metadata_.num_a_groups_ * kMinBlocksInMax * 2; ++i) {
     for (int j = 0; j < kVecNumel; ++j) {
@@ -134,32 +154,128 @@ void Compressor::matchBlocks() {
       block_matches_indices_.get()[i][j] = 0;
     }
   }
-  std::chrono::duration<double> reorder_time{0}, match_time{0}, reduce_time{0};
+  num_full_search_groups_ = 0;
+  if (same_blocks_.empty()) {
+    matchGroups<kProfile>({});
+    return;
+  }
+  // frames of a sequence search around the previous frame's matches first. Groups whose blocks' previous coverings
+  // got much worse with the matches found than they were in the previous frame search the rest of the helper as well
+  auto mask = seedMask();
+  matchGroups<kProfile>(mask);
+  for (int a_group = 0; a_group < metadata_.num_a_groups_; ++a_group) {
+    float error = 0;
+    float reference_error = 0;
+    for (int vpos = 0; vpos < kVecNumel; ++vpos) {
+      int block_num = a_group * kVecNumel + vpos;
+      if (block_num >= metadata_.num_a_blocks_ || same_blocks_[block_num]) {
+        continue;
+      }
+      for (const auto& leaf : history_->block_leafs_[block_num]) {
+        error += block_errors_.get()[a_group * kMinBlocksInMax * 2 + metadata_.level_offsets_[leaf.level_] +
+                                     leaf.ipos_][vpos];
+      }
+      reference_error += history_->block_errors_[block_num] * kSeedErrorSlack + kMaxBlockNumel * kSequenceMseSlack;
+    }
+    bool regressed = error > reference_error;
+    for (int b_group = 0; b_group < metadata_.num_b_groups_; ++b_group) {
+      char& m = mask[a_group * metadata_.num_b_groups_ + b_group];
+      m = regressed && !m;
+    }
+    num_full_search_groups_ += regressed;
+  }
+  if (num_full_search_groups_ > 0) {
+    matchGroups<kProfile>(mask);
+  }
+  telemetry_.count("same blocks", std::count(same_blocks_.begin(), same_blocks_.end(), true));
+  telemetry_.count("fully searched groups", num_full_search_groups_);
+}
+
+void Compressor::matchBlocks() {
+  withBlockProfile(metadata_.profile_num_, [&](auto profile) { matchBlocks<decltype(profile)::value>(); });
+}
+
+std::vector<char> Compressor::seedMask() const {
+  int b_cols = (metadata_.sz_.second / 2 + kSearchStride - 1) / kSearchStride;
+  int b_rows = metadata_.num_b_blocks_ / b_cols;
+  std::vector<char> mask(metadata_.num_a_groups_ * metadata_.num_b_groups_, 0);
+  for (int block_num = 0; block_num < metadata_.num_a_blocks_; ++block_num) {
+    if (same_blocks_[block_num]) {
+      continue;
+    }
+    char* group_mask = mask.data() + block_num / kVecNumel * metadata_.num_b_groups_;
+    for (const auto& leaf : history_->block_leafs_[block_num]) {
+      int row = leaf.match_ / b_cols;
+      int col = leaf.match_ % b_cols;
+      int begin_col = std::max(col - kSeedRadius, 0);
+      int end_col = std::min(col + kSeedRadius, b_cols - 1);
+      for (int r = std::max(row - kSeedRadius, 0); r <= std::min(row + kSeedRadius, b_rows - 1); ++r) {
+        for (int g = (r * b_cols + begin_col) / kVecNumel; g <= (r * b_cols + end_col) / kVecNumel; ++g) {
+          group_mask[g] = 1;
+        }
+      }
+    }
+  }
+  return mask;
+}
+
+template <int kProfile>
+void Compressor::matchGroups(const std::vector<char>& mask) {
+  constexpr int kMaxBlockNumel = kBlockProfiles[kProfile].max_numel_;
+  constexpr int kMinBlocksInMax = kBlockProfiles[kProfile].min_blocks_in_max_;
+  // the stage covers whole searches, the kernels below run a few microseconds each
+  ScopedStage stage{telemetry_, "match"};
+  const float* __restrict__ b_mem = helper().mem();
+  auto buf = allocVecs(kMinBlocksInMax * kVecNumel);
   IVec b_block_nums{};
   for (int i = 0; i < kVecNumel; ++i) {
     b_block_nums[i] = i;
   }
-  for (int vnum = 0; vnum < metadata_.num_b_groups_; ++vnum) {
-    IVec group_offsets;
-    for (int vpos = 0; vpos < kVecNumel; ++vpos) {
-      group_offsets[vpos] = metadata_.b_block_offsets_[vnum * kVecNumel + vpos];
-    }
-    auto start = std::chrono::high_resolution_clock::now();
-    reorder(b_groups(), b_mem, b_mean(), b_sumsq(), metadata_.pt_, group_offsets);
-    auto reorder_finished = std::chrono::high_resolution_clock::now();
-    for (int a_group = 0; a_group < metadata_.num_a_groups_; ++a_group) {
-      auto start_match = std::chrono::high_resolution_clock::now();
-      matchGroup(a_groups() + a_group * kMaxBlockNumel, b_groups(), a_sumsq() + a_group * kMinBlocksInMax, b_sumsq(),
-                 buf.get());
-      auto end_match = std::chrono::high_resolution_clock::now();
-      reduce(buf.get(), block_errors_.get() + a_group * kMinBlocksInMax * 2,
-             block_matches_indices_.get() + a_group * kMinBlocksInMax * 2, b_block_nums,
-             a_mean() + a_group * kMinBlocksInMax * 2, b_mean());
-      auto end_reduce = std::chrono::high_resolution_clock::now();
-      match_time_ += std::chrono::duration<double>(end_match - start_match);
-      reduce_time_ += std::chrono::duration<double>(end_reduce - end_match);
+  int64_t num_matched = 0;
+  auto searched = [&](int a_group, int b_group) {
+    return mask.empty() || mask[a_group * metadata_.num_b_groups_ + b_group];
+  };
+  int vnum = 0;
+  while (vnum < metadata_.num_b_groups_) {
+    TraceSpan span{"match b groups", vnum};
+    int end = std::min(vnum + kTracedBGroups, metadata_.num_b_groups_);
+    for (; vnum < end; ++vnum, b_block_nums += kVecNumel) {
+      bool any = mask.empty();
+      for (int a_group = 0; a_group < metadata_.num_a_groups_ && !any; ++a_group) {
+        any = searched(a_group, vnum);
+      }
+      if (!any) {
+        continue;
+      }
+      IVec group_offsets;
+      for (int vpos = 0; vpos < kVecNumel; ++vpos) {
+        group_offsets[vpos] = metadata_.b_block_offsets_[vnum * kVecNumel + vpos];
+      }
+      reorder<kProfile>(b_groups(), b_mem, b_mean(), b_sumsq(), metadata_.pt_, group_offsets);
+      for (int a_group = 0; a_group < metadata_.num_a_groups_; ++a_group) {
+        if (!searched(a_group, vnum)) {
+          continue;
+        }
+        matchGroup<kProfile>(a_groups() + a_group * kMaxBlockNumel, b_groups(), a_sumsq() + a_group * kMinBlocksInMax,
+                             b_sumsq(), buf.get());
+        reduce<kProfile>(buf.get(), block_errors_.get() + a_group * kMinBlocksInMax * 2,
+                         block_matches_indices_.get() + a_group * kMinBlocksInMax * 2, b_block_nums,
+                         a_mean() + a_group * kMinBlocksInMax * 2, b_mean());
+        ++num_matched;
+      }
     }
-    b_block_nums += kVecNumel;
-    reorder_time_ += std::chrono::duration<double>(reorder_finished - start);
   }
+  telemetry_.count("matched group pairs", num_matched);
 }
+
+// kernels of every block profile, for fcomp_bench
+static_assert(kNumBlockProfiles == 3, "kernels of new profiles should be instantiated");
+template void reorder<0>(Vec*, const float*, Vec*, Vec*, const Pattern&, const IVec&);
+template void reorder<1>(Vec*, const float*, Vec*, Vec*, const Pattern&, const IVec&);
+template void reorder<2>(Vec*, const float*, Vec*, Vec*, const Pattern&, const IVec&);
+template void matchGroup<0>(const Vec*, const Vec*, Vec*, Vec*, Vec*);
+template void matchGroup<1>(const Vec*, const Vec*, Vec*, Vec*, Vec*);
+template void matchGroup<2>(const Vec*, const Vec*, Vec*, Vec*, Vec*);
+template void reduce<0>(Vec*, Vec*, IVec*, const IVec, const Vec*, const Vec*);
+template void reduce<1>(Vec*, Vec*, IVec*, const IVec, const Vec*, const Vec*);
+template void reduce<2>(Vec*, Vec*, IVec*, const IVec, const Vec*, const Vec*);
@@ -1,34 +1,51 @@
 #include "metrics.h"
 
+#include <algorithm>
 #include <cmath>
+#include <optional>
+#include <thread>
+
+#include "formats.h"
+
+constexpr float kMaxPSNR = 60;
+// SSIM stabilisers for 8 bit values
+constexpr double kSsimC1 = (0.01 * 255) * (0.01 * 255);
+constexpr double kSsimC2 = (0.03 * 255) * (0.03 * 255);
+// windows are 2x2 blocks of kSsimBlock pixels square
+constexpr int kSsimBlock = 4;
+constexpr int kSsimWindowNumel = kSsimBlock * kSsimBlock * 4;
+constexpr double kMsSsimWeights[] = {0.0448, 0.2856, 0.3001, 0.2363, 0.1333};
+constexpr int kMsSsimScales = std::size(kMsSsimWeights);
+constexpr float kErrorMapGain = 8;
+// error map cells are blocks of this size whatever profile the stream was coded with
+constexpr Size kErrorMapBlockSize = kBlockProfiles[kDefaultBlockProfile].max_size_;
+
+static_assert(kVecNumel == kSsimBlock * 2);
 
 float MSE(const Channel& c1, const Channel& c2) {
-  constexpr int kNums = 16;
-  float total_error = 0;
+  // vector partial sums are flushed into double every kChunk pixels, so large channels lose no precision
+  constexpr int kChunk = 1024;
   const auto* c1mem = c1.mem();
   const auto* c2mem = c2.mem();
+  int numel = c1.numel();
+  int vec_end = numel - numel % kVecNumel;
+  double total_error = 0;
   int i = 0;
-  for (; i + kNums <= c1.numel(); i += kNums) {
-    float cur_error = 0;
-    for (int j = 0; j < kNums; ++j) {
-      float diff = c1mem[i + j] - c2mem[i + j];
+  while (i < vec_end) {
+    Vec cur_error{0};
+    for (int end = std::min(vec_end, i + kChunk); i < end; i += kVecNumel) {
+      Vec diff = loadVec(c1mem + i) - loadVec(c2mem + i);
       cur_error += diff * diff;
     }
-    total_error += cur_error;
+    total_error += vecSum(cur_error);
   }
-  float cur_error = 0;
-  for (int j = i; j < c1.numel(); ++j) {
-    for (int j = 0; j < kNums; ++j) {
-      float diff = c1mem[j] - c2mem[j];
-      cur_error += diff * diff;
-    }
+  for (; i < numel; ++i) {
+    float diff = c1mem[i] - c2mem[i];
+    total_error += diff * diff;
   }
-  total_error += cur_error;
-  return total_error / c1.numel();
+  return total_error / numel;
 }
 
-constexpr float kMaxPSNR = 60;
-
 float PSNR(float mse, float range) { return std::min<float>(kMaxPSNR, 10 * std::log10(range * range / mse)); }
 
 float PSNR(const Channel& c1, const Channel& c2) { return PSNR(MSE(c1, c2), kBitRange); }
@@ -42,3 +59,281 @@ float PSNR(const Image& i1, const Image& i2) {
     return (PSNR(c1[0], c2[0]) * kYChannelWeight + PSNR(c1[1], c2[1]) + PSNR(c1[2], c2[2])) / (kYChannelWeight + 2);
   }
 }
+
+namespace {
+
+// sums over a block of the reference a and the decoded b
+struct BlockSums {
+  float a_ = 0;
+  float b_ = 0;
+  float aa_ = 0;
+  float bb_ = 0;
+  float ab_ = 0;
+  float dd_ = 0;
+};
+
+// what a pass over one scale leaves: sums of every whole block, squared error of every band of block rows, the one
+// of remaining rows last, and both channels box filtered for the next scale
+struct ScalePass {
+  int bh_;
+  int bw_;
+  std::vector<BlockSums> blocks_;
+  std::vector<double> band_errors_;
+  std::optional<Channel> next_a_;
+  std::optional<Channel> next_b_;
+};
+
+// calls fn(i) for every i of [0, n), contiguous ranges of them on different threads
+template <typename Fn>
+void parallelFor(int n, int num_threads, const Fn& fn) {
+  num_threads = std::clamp(num_threads, 1, std::max(n, 1));
+  auto range = [&](int thread_num) {
+    for (int i = thread_num * n / num_threads; i < (thread_num + 1) * n / num_threads; ++i) {
+      fn(i);
+    }
+  };
+  std::vector<std::jthread> threads;
+  for (int thread_num = 1; thread_num < num_threads; ++thread_num) {
+    threads.emplace_back(range, thread_num);
+  }
+  range(0);
+}
+
+float sumLanes(Vec v, int begin) { return v[begin] + v[begin + 1] + v[begin + 2] + v[begin + 3]; }
+
+// 2x2 box filter of rows [begin_row, end_row) of the next scale
+void downsampleRows(const Channel& chl, Channel& next, int begin_row, int end_row) {
+  for (int h = begin_row; h < end_row; ++h) {
+    const float* top = &chl.get(h * 2, 0);
+    const float* bottom = &chl.get(h * 2 + 1, 0);
+    float* dst = &next.get(h, 0);
+    for (int w = 0; w < next.width(); ++w) {
+      dst[w] = (top[w * 2] + top[w * 2 + 1] + bottom[w * 2] + bottom[w * 2 + 1]) / 4;
+    }
+  }
+}
+
+ScalePass passScale(const Channel& a, const Channel& b, bool downsample, int num_threads) {
+  int h = a.height();
+  int w = a.width();
+  ScalePass pass{h / kSsimBlock, w / kSsimBlock};
+  pass.blocks_.resize(pass.bh_ * pass.bw_);
+  pass.band_errors_.resize(pass.bh_ + 1, 0);
+  if (downsample) {
+    pass.next_a_.emplace(Size{h / 2, w / 2});
+    pass.next_b_.emplace(Size{h / 2, w / 2});
+  }
+  int blocks_w = pass.bw_ * kSsimBlock;
+  // every band of block rows is read once: its sums, its error and its rows of the next scale are taken while it is
+  // in cache
+  auto band = [&](int band_num) {
+    BlockSums* blocks = pass.blocks_.data() + band_num * pass.bw_;
+    int top = band_num * kSsimBlock;
+    double error = 0;
+    int x = 0;
+    // two blocks per vector
+    for (; x + kVecNumel <= blocks_w; x += kVecNumel) {
+      Vec sa{0}, sb{0}, saa{0}, sbb{0}, sab{0}, sdd{0};
+      for (int r = 0; r < kSsimBlock; ++r) {
+        Vec va = loadVec(&a.get(top + r, x));
+        Vec vb = loadVec(&b.get(top + r, x));
+        Vec diff = va - vb;
+        sa += va;
+        sb += vb;
+        saa += va * va;
+        sbb += vb * vb;
+        sab += va * vb;
+        sdd += diff * diff;
+      }
+      for (int half = 0; half < 2; ++half) {
+        int lane = half * kSsimBlock;
+        blocks[x / kSsimBlock + half] = {sumLanes(sa, lane),  sumLanes(sb, lane),  sumLanes(saa, lane),
+                                         sumLanes(sbb, lane), sumLanes(sab, lane), sumLanes(sdd, lane)};
+      }
+    }
+    // odd last block and columns past whole blocks
+    for (; x < w; ++x) {
+      for (int r = 0; r < kSsimBlock; ++r) {
+        float va = a.get(top + r, x);
+        float vb = b.get(top + r, x);
+        float diff = va - vb;
+        if (x >= blocks_w) {
+          error += diff * diff;
+          continue;
+        }
+        auto& sums = blocks[x / kSsimBlock];
+        sums.a_ += va;
+        sums.b_ += vb;
+        sums.aa_ += va * va;
+        sums.bb_ += vb * vb;
+        sums.ab_ += va * vb;
+        sums.dd_ += diff * diff;
+      }
+    }
+    for (int block_num = 0; block_num < pass.bw_; ++block_num) {
+      error += blocks[block_num].dd_;
+    }
+    pass.band_errors_[band_num] = error;
+    if (downsample) {
+      downsampleRows(a, *pass.next_a_, band_num * kSsimBlock / 2, (band_num + 1) * kSsimBlock / 2);
+      downsampleRows(b, *pass.next_b_, band_num * kSsimBlock / 2, (band_num + 1) * kSsimBlock / 2);
+    }
+  };
+  parallelFor(pass.bh_, num_threads, band);
+
+  double error = 0;
+  for (int y = pass.bh_ * kSsimBlock; y < h; ++y) {
+    for (int x = 0; x < w; ++x) {
+      float diff = a.get(y, x) - b.get(y, x);
+      error += diff * diff;
+    }
+  }
+  pass.band_errors_.back() = error;
+  if (downsample) {
+    downsampleRows(a, *pass.next_a_, pass.bh_ * kSsimBlock / 2, h / 2);
+    downsampleRows(b, *pass.next_b_, pass.bh_ * kSsimBlock / 2, h / 2);
+  }
+  return pass;
+}
+
+// mean SSIM and mean contrast-structure term over windows of 2x2 blocks, 1 for both without windows
+std::pair<double, double> windowsMean(const ScalePass& pass, int num_threads) {
+  int wh = pass.bh_ - 1;
+  int ww = pass.bw_ - 1;
+  if (wh <= 0 || ww <= 0) {
+    return {1, 1};
+  }
+  std::vector<std::pair<double, double>> row_sums(wh);
+  parallelFor(wh, num_threads, [&](int y) {
+    double ssim = 0;
+    double cs = 0;
+    for (int x = 0; x < ww; ++x) {
+      double sa = 0, sb = 0, saa = 0, sbb = 0, sab = 0;
+      for (int block : {y * pass.bw_ + x, y * pass.bw_ + x + 1, (y + 1) * pass.bw_ + x, (y + 1) * pass.bw_ + x + 1}) {
+        const auto& sums = pass.blocks_[block];
+        sa += sums.a_;
+        sb += sums.b_;
+        saa += sums.aa_;
+        sbb += sums.bb_;
+        sab += sums.ab_;
+      }
+      double mean_a = sa / kSsimWindowNumel;
+      double mean_b = sb / kSsimWindowNumel;
+      double var_a = std::max(saa / kSsimWindowNumel - mean_a * mean_a, 0.0);
+      double var_b = std::max(sbb / kSsimWindowNumel - mean_b * mean_b, 0.0);
+      double cov = sab / kSsimWindowNumel - mean_a * mean_b;
+      double luminance = (2 * mean_a * mean_b + kSsimC1) / (mean_a * mean_a + mean_b * mean_b + kSsimC1);
+      double contrast_structure = (2 * cov + kSsimC2) / (var_a + var_b + kSsimC2);
+      ssim += luminance * contrast_structure;
+      cs += contrast_structure;
+    }
+    row_sums[y] = {ssim, cs};
+  });
+  double ssim = 0;
+  double cs = 0;
+  for (auto [row_ssim, row_cs] : row_sums) {
+    ssim += row_ssim;
+    cs += row_cs;
+  }
+  return {ssim / (wh * ww), cs / (wh * ww)};
+}
+
+void fillErrorMap(const ScalePass& pass, ChannelQuality& quality) {
+  constexpr int kBlocksInMaxH = kErrorMapBlockSize.first / kSsimBlock;
+  constexpr int kBlocksInMaxW = kErrorMapBlockSize.second / kSsimBlock;
+  quality.map_sz_ = {(pass.bh_ + kBlocksInMaxH - 1) / kBlocksInMaxH, (pass.bw_ + kBlocksInMaxW - 1) / kBlocksInMaxW};
+  int map_numel = quality.map_sz_.first * quality.map_sz_.second;
+  std::vector<double> errors(map_numel, 0);
+  std::vector<int> numels(map_numel, 0);
+  for (int y = 0; y < pass.bh_; ++y) {
+    for (int x = 0; x < pass.bw_; ++x) {
+      int cell = y / kBlocksInMaxH * quality.map_sz_.second + x / kBlocksInMaxW;
+      errors[cell] += pass.blocks_[y * pass.bw_ + x].dd_;
+      numels[cell] += kSsimBlock * kSsimBlock;
+    }
+  }
+  quality.block_mse_.resize(map_numel);
+  for (int cell = 0; cell < map_numel; ++cell) {
+    quality.block_mse_[cell] = errors[cell] / numels[cell];
+  }
+}
+
+}  // namespace
+
+ChannelQuality measureQuality(const Channel& reference, const Channel& decoded, bool error_map, int num_threads) {
+  assertWithMessage(reference.size() == decoded.size(), "channels shape mismatch");
+  ChannelQuality quality;
+  // MS-SSIM takes scales while windows fit them, weights of the ones taken are renormalized
+  int num_scales = 1;
+  while (num_scales < kMsSsimScales &&
+         std::min(reference.height(), reference.width()) >> num_scales >= kSsimBlock * 2) {
+    ++num_scales;
+  }
+  const Channel* a = &reference;
+  const Channel* b = &decoded;
+  std::optional<Channel> scaled_a, scaled_b;
+  double ms_ssim = 1;
+  double weights_sum = 0;
+  for (int scale = 0; scale < num_scales; ++scale) {
+    bool last = scale + 1 == num_scales;
+    auto pass = passScale(*a, *b, !last, num_threads);
+    auto [ssim, cs] = windowsMean(pass, num_threads);
+    if (scale == 0) {
+      double error = 0;
+      for (double band_error : pass.band_errors_) {
+        error += band_error;
+      }
+      quality.mse_ = error / reference.numel();
+      quality.psnr_ = PSNR(quality.mse_);
+      quality.ssim_ = ssim;
+      if (error_map) {
+        fillErrorMap(pass, quality);
+      }
+    }
+    ms_ssim *= std::pow(std::max(last ? ssim : cs, 0.0), kMsSsimWeights[scale]);
+    weights_sum += kMsSsimWeights[scale];
+    if (!last) {
+      scaled_a = std::move(pass.next_a_);
+      scaled_b = std::move(pass.next_b_);
+      a = &*scaled_a;
+      b = &*scaled_b;
+    }
+  }
+  quality.ms_ssim_ = std::pow(ms_ssim, 1 / weights_sum);
+  return quality;
+}
+
+QualityMeter::QualityMeter(const Image& reference, int num_threads)
+    : reference_{reference.extractChannels()}, num_threads_{num_threads} { }
+
+Quality QualityMeter::measure(const Image& decoded, bool error_maps) const {
+  auto channels = decoded.extractChannels();
+  assertWithMessage(channels.size() == reference_.size(), "images have different numbers of channels");
+  Quality quality;
+  float weights_sum = 0;
+  for (int channel_num = 0; channel_num < std::min(channels.size(), reference_.size()); ++channel_num) {
+    float weight = channel_num == 0 && channels.size() == 3 ? kYChannelWeight : 1;
+    const auto& channel = quality.channels_.emplace_back(
+        measureQuality(reference_[channel_num], channels[channel_num], error_maps, num_threads_));
+    quality.psnr_ += channel.psnr_ * weight;
+    quality.ssim_ += channel.ssim_ * weight;
+    quality.ms_ssim_ += channel.ms_ssim_ * weight;
+    weights_sum += weight;
+  }
+  quality.psnr_ /= weights_sum;
+  quality.ssim_ /= weights_sum;
+  quality.ms_ssim_ /= weights_sum;
+  return quality;
+}
+
+void saveErrorMap(const ChannelQuality& quality, const std::string& path) {
+  Size sz{quality.map_sz_.first * kErrorMapBlockSize.first, quality.map_sz_.second * kErrorMapBlockSize.second};
+  std::vector<unsigned char> pixels(sz.first * sz.second);
+  for (int h = 0; h < sz.first; ++h) {
+    for (int w = 0; w < sz.second; ++w) {
+      int cell = h / kErrorMapBlockSize.first * quality.map_sz_.second + w / kErrorMapBlockSize.second;
+      pixels[h * sz.second + w] = std::min(std::sqrt(quality.block_mse_[cell]) * kErrorMapGain, 255.f);
+    }
+  }
+  writePixels(path, pixels.data(), sz, 1);
+}
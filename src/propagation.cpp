@@ -1,11 +1,16 @@
 #include "propagation.h"
 
-#include <chrono>
-
 #include "compressor.h"
+#include "kernels.h"
+#include "trace.h"
 
+template <int kProfile>
 void setupInnerPropagation(const Vec* __restrict__ block_errors, Storage<VecHolder<Vec>>& coverings_errors,
                            int num_groups) {
+  constexpr int kMinBlocksInMax = kBlockProfiles[kProfile].min_blocks_in_max_;
+  constexpr int kMinBlockNumel = kBlockProfiles[kProfile].min_numel_;
+  constexpr int kMinBlockLevel = kBlockProfiles[kProfile].min_level_;
+  constexpr int kMaxBlockLevel = kBlockProfiles[kProfile].max_level_;
   int offset = 0;
   for (int level = kMinBlockLevel; level <= kMaxBlockLevel; ++level) {
     Vec* __restrict__ mem = coverings_errors[level].get();
@@ -21,10 +26,16 @@ void setupInnerPropagation(const Vec* __restrict__ block_errors, Storage<VecHold
   }
 }
 
+template <int kProfile>
 void propagateInner(Storage<VecHolder<Vec>>& coverings_errors, Storage<VecHolder<IVec>>& coverings_num_left_leafs,
                     int num_groups) {
+  constexpr int kMinBlocksInMax = kBlockProfiles[kProfile].min_blocks_in_max_;
+  constexpr int kMinBlockNumel = kBlockProfiles[kProfile].min_numel_;
+  constexpr int kMinBlockLevel = kBlockProfiles[kProfile].min_level_;
+  constexpr int kMaxBlockLevel = kBlockProfiles[kProfile].max_level_;
   int offset = 0;
   for (int level = kMinBlockLevel + 1; level <= kMaxBlockLevel; ++level) {
+    TraceSpan span{"propagate level", level};
     Vec* __restrict__ cur_erorrs_mem = coverings_errors[level].get();
     IVec* __restrict__ cur_num_left_leafs_mem = coverings_num_left_leafs[level].get();
     Vec* __restrict__ prev_mem = coverings_errors[level - 1].get();
@@ -193,6 +204,7 @@ std::vector<int> Propagator::distributeLeafsForPrevLevel(const std::vector<int>&
 }
 
 CoveringsErrors Propagator::buildNextLayer(const CoveringsErrors& prev_level_coverings_errors, int target_num_leafs) {
+  TraceSpan span{"propagation layer", static_cast<int>(layer_num_left_leafs_.size())};
   int new_size = (prev_level_coverings_errors.size() + 1) / 2;
   CoveringsErrors next_level_coverings_errors(new_size);
   layer_num_left_leafs_.push_back(CoveringsNumLeftLeafs(new_size));
@@ -209,26 +221,38 @@ CoveringsErrors Propagator::buildNextLayer(const CoveringsErrors& prev_level_cov
 }
 
 std::vector<float> Compressor::propagate(int target_num_leafs) {
-  auto start = std::chrono::high_resolution_clock::now();
-  setupInnerPropagation(block_errors_.get(), coverings_errors_, metadata_.num_a_groups_);
-  propagateInner(coverings_errors_, coverings_num_leafs_in_left_, metadata_.num_a_groups_);
-  auto internal_prop_finished = std::chrono::high_resolution_clock::now();
+  {
+    ScopedStage stage{telemetry_, "internal propagation"};
+    withBlockProfile(metadata_.profile_num_, [&](auto profile) {
+      constexpr int kProfile = decltype(profile)::value;
+      setupInnerPropagation<kProfile>(block_errors_.get(), coverings_errors_, metadata_.num_a_groups_);
+      propagateInner<kProfile>(coverings_errors_, coverings_num_leafs_in_left_, metadata_.num_a_groups_);
+    });
+  }
+  ScopedStage stage{telemetry_, "external propagation"};
   CoveringsErrors max_blocks_covering_errors(metadata_.num_a_blocks_);
   for (int b = 0; b < metadata_.num_a_blocks_; ++b) {
     int cg = b / kVecNumel;
     int cv = b % kVecNumel;
-    int max_leafs_in_maximum_block = kMinBlocksInMax;
+    int max_leafs_in_maximum_block = metadata_.profile_.min_blocks_in_max_;
     max_blocks_covering_errors[b].resize(max_leafs_in_maximum_block);
     for (int nl = 0; nl < max_leafs_in_maximum_block; ++nl) {
       max_blocks_covering_errors[b][nl] =
-          coverings_errors_[kMaxBlockLevel].get()[cg * max_leafs_in_maximum_block + nl][cv];
+          coverings_errors_[metadata_.profile_.max_level_].get()[cg * max_leafs_in_maximum_block + nl][cv];
+    }
+    // blocks repeating the previous frame cost a flag whatever leafs they are given
+    if (!same_blocks_.empty() && same_blocks_[b]) {
+      std::fill(max_blocks_covering_errors[b].begin(), max_blocks_covering_errors[b].end(), same_errors_[b]);
     }
   }
-  auto result = propagator_.propagate(max_blocks_covering_errors, target_num_leafs);
-  auto external_prop_finished = std::chrono::high_resolution_clock::now();
-  auto prop_finished = std::chrono::high_resolution_clock::now();
-  int_prop_time_ = std::chrono::duration<double>(internal_prop_finished - start);
-  ext_prop_time_ = std::chrono::duration<double>(external_prop_finished - internal_prop_finished);
-
-  return result;
+  return propagator_.propagate(max_blocks_covering_errors, target_num_leafs);
 }
+
+// kernels of every block profile, for fcomp_bench
+static_assert(kNumBlockProfiles == 3, "kernels of new profiles should be instantiated");
+template void setupInnerPropagation<0>(const Vec*, Storage<VecHolder<Vec>>&, int);
+template void setupInnerPropagation<1>(const Vec*, Storage<VecHolder<Vec>>&, int);
+template void setupInnerPropagation<2>(const Vec*, Storage<VecHolder<Vec>>&, int);
+template void propagateInner<0>(Storage<VecHolder<Vec>>&, Storage<VecHolder<IVec>>&, int);
+template void propagateInner<1>(Storage<VecHolder<Vec>>&, Storage<VecHolder<IVec>>&, int);
+template void propagateInner<2>(Storage<VecHolder<Vec>>&, Storage<VecHolder<IVec>>&, int);
@@ -0,0 +1,105 @@
+#include "compressor.h"
+
+// in this file the compressor codes a frame of a sequence against the previous one
+
+void ChannelHistory::renormalize(std::pair<int, int> from, std::pair<int, int> to) {
+  if (from == to) {
+    return;
+  }
+  float scale = float(to.second - to.first) / (from.second - from.first);
+  for (int block_num = 0; block_num < block_leafs_.size(); ++block_num) {
+    for (auto& leaf : block_leafs_[block_num]) {
+      leaf.brightness_ = ::renormalize(leaf.brightness_, from, to);
+    }
+    block_errors_[block_num] /= scale * scale;
+  }
+}
+
+bool Compressor::withinSlack(float error, float reference_error) const {
+  return error <= reference_error * kSequenceErrorSlack + metadata_.profile_.max_numel_ * kSequenceMseSlack;
+}
+
+float Compressor::leafsError(int block_num, const std::vector<ChannelHistory::Leaf>& leafs) const {
+  // leafs are measured the way restore applies them: source block with its mean replaced by leaf's brightness
+  int stride = metadata_.sz_.second;
+  float error = 0;
+  for (auto [level, ipos, brightness, match] : leafs) {
+    auto sz = getBlockSize(level);
+    const float* a = a_chl_.mem() + metadata_.a_block_offsets_[block_num] + metadata_.pt_[level][ipos];
+    const float* b = helper().mem() + metadata_.b_block_offsets_[match] + metadata_.pt_[level][ipos];
+    float b_sum = 0;
+    for (int h = 0; h < sz.first; ++h) {
+      for (int w = 0; w < sz.second; ++w) {
+        b_sum += b[h * stride + w];
+      }
+    }
+    float offset = brightness - b_sum / (sz.first * sz.second);
+    for (int h = 0; h < sz.first; ++h) {
+      for (int w = 0; w < sz.second; ++w) {
+        float diff = a[h * stride + w] - b[h * stride + w] - offset;
+        error += diff * diff;
+      }
+    }
+  }
+  return error;
+}
+
+void Compressor::findSameBlocks() {
+  same_blocks_.clear();
+  same_errors_.clear();
+  if (history_ == nullptr || history_->empty()) {
+    return;
+  }
+  same_blocks_.resize(metadata_.num_a_blocks_);
+  same_errors_.resize(metadata_.num_a_blocks_);
+  for (int block_num = 0; block_num < metadata_.num_a_blocks_; ++block_num) {
+    same_errors_[block_num] = leafsError(block_num, history_->block_leafs_[block_num]);
+    same_blocks_[block_num] = withinSlack(same_errors_[block_num], history_->block_errors_[block_num]);
+  }
+}
+
+std::pair<float, float> Compressor::historyErrors() const {
+  float error = 0;
+  float reference_error = 0;
+  for (int block_num = 0; block_num < same_errors_.size(); ++block_num) {
+    error += same_errors_[block_num];
+    reference_error += history_->block_errors_[block_num];
+  }
+  return {error, reference_error};
+}
+
+void Compressor::dropHistory() {
+  same_blocks_.clear();
+  same_errors_.clear();
+}
+
+void Compressor::collectLeafs(int level, int block_num, int ipos, int num_leafs,
+                              std::vector<ChannelHistory::Leaf>& leafs) {
+  if (level == metadata_.profile_.min_level_ || num_leafs == 0) {
+    int vnum = block_num / kVecNumel;
+    int vpos = block_num % kVecNumel;
+    int idx = vnum * metadata_.profile_.min_blocks_in_max_ * 2 + metadata_.level_offsets_[level] + ipos;
+    leafs.push_back({level, ipos, clamp(a_mean()[idx][vpos]), block_matches_indices_.get()[idx][vpos]});
+    return;
+  }
+  int l_num_leafs = numLeafsInLeft(level, block_num, ipos, num_leafs);
+  collectLeafs(level - 1, block_num, ipos * 2, l_num_leafs, leafs);
+  collectLeafs(level - 1, block_num, ipos * 2 + 1, num_leafs - l_num_leafs - 1, leafs);
+}
+
+void Compressor::updateHistory() {
+  if (history_ == nullptr) {
+    return;
+  }
+  history_->block_leafs_.resize(metadata_.num_a_blocks_);
+  history_->block_errors_.resize(metadata_.num_a_blocks_);
+  for (int block_num = 0; block_num < metadata_.num_a_blocks_; ++block_num) {
+    if (!same_blocks_.empty() && same_blocks_[block_num]) {
+      continue;
+    }
+    auto& leafs = history_->block_leafs_[block_num];
+    leafs.clear();
+    collectLeafs(metadata_.profile_.max_level_, block_num, 0, leafs_per_block_[block_num], leafs);
+    history_->block_errors_[block_num] = leafsError(block_num, leafs);
+  }
+}
@@ -1,7 +1,10 @@
-#include <chrono>
+#include <algorithm>
+#include <bit>
+#include <thread>
 
 #include "compressor.h"
 #include "decompressor.h"
+#include "entropy.h"
 
 int clamp(float f) {
   int i = f + 0.5;
@@ -10,68 +13,338 @@ int clamp(float f) {
   return i;
 }
 
-void Compressor::serializeNode(WStream& stream, int level, int vnum, int vpos, int ipos, int num_leafs) {
-  auto dump = [&] {
-    int br = clamp(a_mean()[vnum * kMinBlocksInMax * 2 + metadata_.level_offsets_[level] + ipos][vpos]);
-    stream.dump(br, kBitDepth);
-    stream.dump(block_matches_indices_.get()[vnum * kMinBlocksInMax * 2 + metadata_.level_offsets_[level] + ipos][vpos],
-                metadata_.bits_for_match_idx_);
-  };
+namespace {
 
-  if (level == kMinBlockLevel) {
-    dump();
-  } else {
-    if (num_leafs == 0) {
-      stream.dump(0, 1);
-      dump();
+// tree fields written raw
+struct RawTreeWriter {
+  WStream& stream_;
+  int bits_for_match_idx_;
+
+  void split(int level, int sibling, bool split) { stream_.dump(split, 1); }
+  void same(bool same) { stream_.dump(same, 1); }
+  void leaf(int level, int mem_offset, int brightness, int match) {
+    // brightness and match index go in one call
+    stream_.dump(static_cast<uint64_t>(brightness) << bits_for_match_idx_ | match, kBitDepth + bits_for_match_idx_);
+  }
+};
+
+struct EntropyTreeWriter {
+  RangeEncoder enc_;
+  LeafCoder coder_;
+
+  void split(int level, int sibling, bool split) { coder_.encodeSplit(enc_, level, sibling, split); }
+  void same(bool same) { coder_.encodeSame(enc_, same); }
+  void leaf(int level, int mem_offset, int brightness, int match) {
+    coder_.encodeLeaf(enc_, level, mem_offset, brightness, match);
+  }
+};
+
+struct RawTreeReader {
+  RStream& stream_;
+  int bits_for_match_idx_;
+
+  bool split(int level, int sibling) { return stream_.extract(1); }
+  bool same() { return stream_.extract(1); }
+  void leaf(int level, int mem_offset, int& brightness, int& match) {
+    uint64_t leaf = stream_.extract(kBitDepth + bits_for_match_idx_);
+    brightness = leaf >> bits_for_match_idx_;
+    match = leaf & ((uint64_t{1} << bits_for_match_idx_) - 1);
+  }
+};
+
+struct EntropyTreeReader {
+  RangeDecoder dec_;
+  LeafCoder coder_;
+
+  bool split(int level, int sibling) { return coder_.decodeSplit(dec_, level, sibling); }
+  bool same() { return coder_.decodeSame(dec_); }
+  void leaf(int level, int mem_offset, int& brightness, int& match) {
+    coder_.decodeLeaf(dec_, level, mem_offset, brightness, match);
+  }
+};
+
+// signed Exp-Golomb code of given order, small magnitudes take the fewest bits
+void dumpSigned(WStream& stream, int value, int order) {
+  unsigned code = (value >= 0 ? value * 2 : -value * 2 - 1) + (1u << order);
+  int width = std::bit_width(code);
+  stream.dump(0, width - 1 - order);
+  stream.dump(code, width);
+}
+
+// zero bits past the end of the stream stop at kMaxSignedPrefix, the caller sees the read pass the end
+int extractSigned(RStream& stream, int order) {
+  int prefix = 0;
+  while (prefix < kMaxSignedPrefix && stream.extract(1) == 0) {
+    ++prefix;
+  }
+  int code = ((1 << (prefix + order)) | stream.extract(prefix + order)) - (1 << order);
+  return code % 2 == 0 ? code / 2 : -(code + 1) / 2;
+}
+
+// children of a split progressive leaf. Match indices are written raw. The parent's brightness is the mean of its
+// children, so the left child's brightness is coded as a difference from it and the right one's as a difference from
+// what the parent mean leaves for it
+struct RefinementWriter {
+  WStream& stream_;
+  int bits_for_match_idx_;
+  int parent_brightness_;
+  int left_brightness_ = -1;
+
+  void leaf(int level, int mem_offset, int brightness, int match) {
+    stream_.dump(match, bits_for_match_idx_);
+    if (left_brightness_ < 0) {
+      dumpSigned(stream_, brightness - parent_brightness_, kRefinementDeltaOrder);
+      left_brightness_ = brightness;
+    } else {
+      dumpSigned(stream_, brightness - (parent_brightness_ * 2 - left_brightness_), 0);
+    }
+  }
+};
+
+struct RefinementReader {
+  RStream& stream_;
+  int bits_for_match_idx_;
+  int parent_brightness_;
+  int left_brightness_ = -1;
+
+  void leaf(int level, int mem_offset, int& brightness, int& match) {
+    match = stream_.extract(bits_for_match_idx_);
+    if (left_brightness_ < 0) {
+      brightness = parent_brightness_ + extractSigned(stream_, kRefinementDeltaOrder);
+      left_brightness_ = brightness;
     } else {
-      stream.dump(1, 1);
-      int l_num_leafs =
-          coverings_num_leafs_in_left_[level]
-              .get()[vnum * kMinBlocksInMax + ipos * metadata_.num_min_blocks_in_level_[level] + num_leafs][vpos];
-      int r_num_leafs = num_leafs - l_num_leafs - 1;
-      serializeNode(stream, level - 1, vnum, vpos, ipos * 2, l_num_leafs);
-      serializeNode(stream, level - 1, vnum, vpos, ipos * 2 + 1, r_num_leafs);
+      brightness = parent_brightness_ * 2 - left_brightness_ + extractSigned(stream_, 0);
     }
   }
+};
+
+}  // namespace
+
+int Compressor::leafIndex(int level, int block_num, int ipos) const {
+  return block_num / kVecNumel * metadata_.profile_.min_blocks_in_max_ * 2 + metadata_.level_offsets_[level] + ipos;
 }
 
-void Compressor::serializeNodes(WStream& stream, const std::vector<int>& leafs_per_block) {
-  for (int block_num = 0; block_num < metadata_.num_a_blocks_; ++block_num) {
-    int vnum = block_num / kVecNumel;
-    int vpos = block_num % kVecNumel;
-    int nleafs = leafs_per_block[block_num];
-    serializeNode(stream, kMaxBlockLevel, vnum, vpos, 0, nleafs);
+template <typename Writer>
+void Compressor::serializeLeaf(Writer& writer, int level, int block_num, int ipos) {
+  int idx = leafIndex(level, block_num, ipos);
+  int vpos = block_num % kVecNumel;
+  int br = clamp(a_mean()[idx][vpos]);
+  int match = block_matches_indices_.get()[idx][vpos];
+  writer.leaf(level, metadata_.a_block_offsets_[block_num] + metadata_.pt_[level][ipos], br, match);
+}
+
+int Compressor::numLeafsInLeft(int level, int block_num, int ipos, int num_leafs) const {
+  int vnum = block_num / kVecNumel;
+  int vpos = block_num % kVecNumel;
+  int idx = vnum * metadata_.profile_.min_blocks_in_max_ + ipos * metadata_.num_min_blocks_in_level_[level] + num_leafs;
+  return coverings_num_leafs_in_left_[level].get()[idx][vpos];
+}
+
+template <typename Writer>
+bool Compressor::serializeNode(Writer& writer, int level, int vnum, int vpos, int ipos, int num_leafs, int sibling) {
+  int block_num = vnum * kVecNumel + vpos;
+  if (level == metadata_.profile_.min_level_) {
+    serializeLeaf(writer, level, block_num, ipos);
+    return false;
   }
+  if (num_leafs == 0) {
+    writer.split(level, sibling, false);
+    serializeLeaf(writer, level, block_num, ipos);
+    return false;
+  }
+  writer.split(level, sibling, true);
+  int l_num_leafs = numLeafsInLeft(level, block_num, ipos, num_leafs);
+  int r_num_leafs = num_leafs - l_num_leafs - 1;
+  bool l_split = serializeNode(writer, level - 1, vnum, vpos, ipos * 2, l_num_leafs, 0);
+  serializeNode(writer, level - 1, vnum, vpos, ipos * 2 + 1, r_num_leafs, 1 + l_split);
+  return true;
+}
+
+template <typename Writer>
+void Compressor::serializeBlock(Writer& writer, int block_num, int num_leafs) {
+  if (!same_blocks_.empty()) {
+    writer.same(same_blocks_[block_num]);
+    if (same_blocks_[block_num]) {
+      return;
+    }
+  }
+  serializeNode(writer, metadata_.profile_.max_level_, block_num / kVecNumel, block_num % kVecNumel, 0, num_leafs, 0);
+}
+
+std::vector<std::vector<char>> Compressor::serializeNodes(const std::vector<int>& leafs_per_block, bool entropy_coded,
+                                                          int rows_per_chunk) {
+  // every rows_per_chunk rows of maximum blocks are a chunk coded from scratch, so chunks can be decoded independently
+  int blocks_per_chunk = metadata_.sz_.second / metadata_.profile_.max_size_.second * rows_per_chunk;
+  std::vector<std::vector<char>> chunks;
+  for (int chunk_begin = 0; chunk_begin < metadata_.num_a_blocks_; chunk_begin += blocks_per_chunk) {
+    auto serializeChunk = [&](auto& writer) {
+      int chunk_end = std::min(chunk_begin + blocks_per_chunk, metadata_.num_a_blocks_);
+      for (int block_num = chunk_begin; block_num < chunk_end; ++block_num) {
+        serializeBlock(writer, block_num, leafs_per_block[block_num]);
+      }
+    };
+    if (entropy_coded) {
+      EntropyTreeWriter writer{RangeEncoder{},
+                               LeafCoder{metadata_.sz_, metadata_.profile_.min_size_, metadata_.bits_for_match_idx_}};
+      serializeChunk(writer);
+      auto bytes = writer.enc_.finish();
+      chunks.emplace_back(bytes.begin(), bytes.end());
+    } else {
+      WStream stream;
+      RawTreeWriter writer{stream, metadata_.bits_for_match_idx_};
+      serializeChunk(writer);
+      chunks.push_back(stream.bytes());
+    }
+  }
+  return chunks;
 }
 
-void Decompressor::deserializeNodes(RStream& stream) {
-  auto start = std::chrono::high_resolution_clock::now();
+void Compressor::serializeBase(int target_num_leafs, WStream& stream) {
+  ScopedStage stage{telemetry_, "serialization"};
+  auto leafs_per_block = propagator_.distributeLeafs(target_num_leafs);
+  RawTreeWriter writer{stream, metadata_.bits_for_match_idx_};
+  frontier_.clear();
   for (int block_num = 0; block_num < metadata_.num_a_blocks_; ++block_num) {
-    deserializeNode(stream, kMaxBlockLevel, block_num, 0);
+    serializeLeaf(writer, metadata_.profile_.max_level_, block_num, 0);
+    frontier_.push_back(FrontierNode{block_num, 0, leafs_per_block[block_num]});
+  }
+}
+
+void Compressor::serializeRefinements(int level, WStream& stream) {
+  ScopedStage stage{telemetry_, "serialization"};
+  std::vector<FrontierNode> next_frontier;
+  for (auto [block_num, ipos, num_leafs] : frontier_) {
+    stream.dump(num_leafs > 0, 1);
+    if (num_leafs == 0) {
+      continue;
+    }
+    int l_num_leafs = numLeafsInLeft(level, block_num, ipos, num_leafs);
+    int parent_brightness = clamp(a_mean()[leafIndex(level, block_num, ipos)][block_num % kVecNumel]);
+    RefinementWriter writer{stream, metadata_.bits_for_match_idx_, parent_brightness};
+    serializeLeaf(writer, level - 1, block_num, ipos * 2);
+    serializeLeaf(writer, level - 1, block_num, ipos * 2 + 1);
+    next_frontier.push_back(FrontierNode{block_num, ipos * 2, l_num_leafs});
+    next_frontier.push_back(FrontierNode{block_num, ipos * 2 + 1, num_leafs - l_num_leafs - 1});
   }
-  auto end = std::chrono::high_resolution_clock::now();
-  deserialization_time_ = std::chrono::duration<double>(end - start);
+  frontier_ = std::move(next_frontier);
 }
 
-void Decompressor::deserializeNode(RStream& stream, int level, int block_num, int subblock_num) {
-  auto extract = [&] {
-    int brightness = stream.extract(kBitDepth);
-    int match = stream.extract(metadata_.bits_for_match_idx_);
-    int a_mem_offset = metadata_.a_block_offsets_[block_num] + metadata_.pt_[level][subblock_num];
-    int b_mem_offset = metadata_.b_block_offsets_[match] + metadata_.pt_[level][subblock_num];
-    translations_.push_back(Translation{a_mem_offset, b_mem_offset, brightness, subblock_sizes_[level]});
+void Decompressor::deserializeNodes(const RStream& stream, const std::vector<int>& chunk_offsets, int rows_per_chunk,
+                                    int num_threads) {
+  ScopedStage stage{telemetry_, "deserialization"};
+  // chunks of rows of maximum blocks are independent, so threads take ranges of them
+  int blocks_per_chunk = metadata_.sz_.second / metadata_.profile_.max_size_.second * rows_per_chunk;
+  int num_chunks = chunk_offsets.size();
+  std::vector<std::vector<Translation>> chunk_translations(num_chunks);
+  if (history_ != nullptr) {
+    history_->resize(metadata_.num_a_blocks_);
+  }
+  auto deserializeChunks = [&](int thread_num, int num_threads) {
+    RStream chunk_stream{stream};
+    for (int chunk = thread_num * num_chunks / num_threads; chunk < (thread_num + 1) * num_chunks / num_threads;
+         ++chunk) {
+      chunk_stream.seek(chunk_offsets[chunk] * CHAR_BIT);
+      auto deserializeChunk = [&](auto& reader) {
+        auto& translations = chunk_translations[chunk];
+        int chunk_end = std::min((chunk + 1) * blocks_per_chunk, metadata_.num_a_blocks_);
+        for (int block_num = chunk * blocks_per_chunk; block_num < chunk_end; ++block_num) {
+          if (inter_ && reader.same()) {
+            const auto& repeated = (*history_)[block_num];
+            translations.insert(translations.end(), repeated.begin(), repeated.end());
+            continue;
+          }
+          int begin = translations.size();
+          deserializeNode(reader, translations, metadata_.profile_.max_level_, block_num, 0, 0);
+          if (history_ != nullptr) {
+            (*history_)[block_num].assign(translations.begin() + begin, translations.end());
+          }
+        }
+      };
+      if (entropy_coded_) {
+        EntropyTreeReader reader{RangeDecoder{chunk_stream.mem(), chunk_stream.end()},
+                                 LeafCoder{metadata_.sz_, metadata_.profile_.min_size_, metadata_.bits_for_match_idx_}};
+        deserializeChunk(reader);
+      } else {
+        RawTreeReader reader{chunk_stream, metadata_.bits_for_match_idx_};
+        deserializeChunk(reader);
+      }
+    }
   };
+  num_threads = std::clamp(num_threads, 1, num_chunks);
+  {
+    std::vector<std::jthread> threads;
+    for (int thread_num = 1; thread_num < num_threads; ++thread_num) {
+      threads.emplace_back(deserializeChunks, thread_num, num_threads);
+    }
+    deserializeChunks(0, num_threads);
+  }
+  translations_.clear();
+  for (const auto& translations : chunk_translations) {
+    translations_.insert(translations_.end(), translations.begin(), translations.end());
+  }
+}
+
+template <typename Reader>
+Decompressor::Translation Decompressor::deserializeLeaf(Reader& reader, int level, int block_num, int subblock_num) {
+  int a_mem_offset = metadata_.a_block_offsets_[block_num] + metadata_.pt_[level][subblock_num];
+  int brightness, match;
+  reader.leaf(level, a_mem_offset, brightness, match);
+  int b_mem_offset = metadata_.b_block_offsets_[match] + metadata_.pt_[level][subblock_num];
+  return Translation{a_mem_offset, b_mem_offset, brightness, level, subblock_sizes_[level]};
+}
+
+template <typename Reader>
+bool Decompressor::deserializeNode(Reader& reader, std::vector<Translation>& translations, int level, int block_num,
+                                   int subblock_num, int sibling) {
+  if (level == metadata_.profile_.min_level_ || !reader.split(level, sibling)) {
+    translations.push_back(deserializeLeaf(reader, level, block_num, subblock_num));
+    return false;
+  }
+  bool l_split = deserializeNode(reader, translations, level - 1, block_num, subblock_num * 2, 0);
+  deserializeNode(reader, translations, level - 1, block_num, subblock_num * 2 + 1, 1 + l_split);
+  return true;
+}
+
+bool Decompressor::deserializeBase(RStream& stream) {
+  ScopedStage stage{telemetry_, "deserialization"};
+  RawTreeReader reader{stream, metadata_.bits_for_match_idx_};
+  int leaf_bits = kBitDepth + metadata_.bits_for_match_idx_;
+  translations_.clear();
+  frontier_.clear();
+  bool complete = true;
+  for (int block_num = 0; block_num < metadata_.num_a_blocks_ && complete; ++block_num) {
+    complete = stream.bitPos() + leaf_bits <= stream.numBits();
+    if (complete) {
+      auto leaf = deserializeLeaf(reader, metadata_.profile_.max_level_, block_num, 0);
+      frontier_.push_back(FrontierNode{block_num, 0, leaf});
+    }
+  }
+  return complete;
+}
 
-  if (level == kMinBlockLevel) {
-    extract();
-  } else {
-    bool split = stream.extract(1);
+bool Decompressor::deserializeRefinements(int level, RStream& stream) {
+  ScopedStage stage{telemetry_, "deserialization"};
+  std::vector<FrontierNode> next_frontier;
+  bool complete = true;
+  for (const auto& [block_num, subblock_num, translation] : frontier_) {
+    // a record cut by the end of the stream leaves its block and all the following ones unsplit
+    complete = complete && stream.bitPos() < stream.numBits();
+    bool split = complete && stream.extract(1);
     if (!split) {
-      extract();
-    } else {
-      deserializeNode(stream, level - 1, block_num, subblock_num * 2);
-      deserializeNode(stream, level - 1, block_num, subblock_num * 2 + 1);
+      translations_.push_back(translation);
+      continue;
+    }
+    RefinementReader reader{stream, metadata_.bits_for_match_idx_, translation.brightness_};
+    auto left = deserializeLeaf(reader, level - 1, block_num, subblock_num * 2);
+    auto right = deserializeLeaf(reader, level - 1, block_num, subblock_num * 2 + 1);
+    complete = stream.bitPos() <= stream.numBits();
+    if (!complete) {
+      translations_.push_back(translation);
+      continue;
     }
+    next_frontier.push_back(FrontierNode{block_num, subblock_num * 2, left});
+    next_frontier.push_back(FrontierNode{block_num, subblock_num * 2 + 1, right});
   }
+  frontier_ = std::move(next_frontier);
+  return complete;
 }
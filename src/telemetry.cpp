@@ -0,0 +1,227 @@
+#include "telemetry.h"
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+std::atomic<bool> hardware_counters_enabled{false};
+
+const char* const kHardwareCounterNames[kNumHardwareCounters] = {"cycles", "instructions", "llc_misses"};
+
+// a group of counters of the calling thread, read together in one syscall
+class HardwareCounters {
+public:
+  HardwareCounters() {
+#ifdef __linux__
+    const uint64_t configs[kNumHardwareCounters] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                                    PERF_COUNT_HW_CACHE_MISSES};
+    for (int i = 0; i < kNumHardwareCounters; ++i) {
+      perf_event_attr attr{};
+      attr.size = sizeof(attr);
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = configs[i];
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_GROUP;
+      fds_[i] = syscall(SYS_perf_event_open, &attr, 0, -1, i == 0 ? -1 : fds_[0], 0);
+      if (fds_[i] < 0) {
+        close();
+        return;
+      }
+    }
+    open_ = true;
+#endif
+  }
+  ~HardwareCounters() { close(); }
+
+  bool read(std::array<uint64_t, kNumHardwareCounters>& values) const {
+#ifdef __linux__
+    struct {
+      uint64_t nr;
+      uint64_t values[kNumHardwareCounters];
+    } group;
+    if (!open_ || ::read(fds_[0], &group, sizeof(group)) != sizeof(group)) {
+      return false;
+    }
+    std::copy(group.values, group.values + kNumHardwareCounters, values.begin());
+    return true;
+#else
+    return false;
+#endif
+  }
+
+private:
+  void close() {
+#ifdef __linux__
+    for (int& fd : fds_) {
+      if (fd >= 0) {
+        ::close(fd);
+      }
+      fd = -1;
+    }
+#endif
+    open_ = false;
+  }
+
+  std::array<int, kNumHardwareCounters> fds_{-1, -1, -1};
+  bool open_ = false;
+};
+
+// counters are opened by the first counted stage of every thread
+bool readHardwareCounters(std::array<uint64_t, kNumHardwareCounters>& values) {
+  if (!hardware_counters_enabled.load(std::memory_order_relaxed)) {
+    return false;
+  }
+  thread_local HardwareCounters counters;
+  return counters.read(values);
+}
+
+template <typename T>
+auto findByName(T& named, std::string_view name) {
+  return std::find_if(named.begin(), named.end(), [&](const auto& entry) { return entry.first == name; });
+}
+
+std::string quoted(const std::string& s) {
+  std::string result = "\"";
+  for (char c : s) {
+    if (c == '"' || c == '\\') {
+      result += '\\';
+    }
+    result += c;
+  }
+  return result + "\"";
+}
+
+std::mutex recorded_mutex;
+Telemetry recorded;
+
+}  // namespace
+
+int Telemetry::stageIndex(std::string_view name) {
+  auto it = findByName(stages_, name);
+  if (it != stages_.end()) {
+    return it - stages_.begin();
+  }
+  stages_.emplace_back(std::string{name}, StageStats{});
+  return stages_.size() - 1;
+}
+
+const StageStats* Telemetry::stage(std::string_view name) const {
+  auto it = findByName(stages_, name);
+  return it != stages_.end() ? &it->second : nullptr;
+}
+
+void Telemetry::addStage(std::string_view name, double seconds) {
+  auto& stats = stages_[stageIndex(name)].second;
+  stats.seconds_ += seconds;
+  ++stats.calls_;
+}
+
+double Telemetry::seconds(std::string_view name) const {
+  const auto* stats = stage(name);
+  return stats != nullptr ? stats->seconds_ : 0;
+}
+
+void Telemetry::count(std::string_view name, int64_t value) {
+  auto it = findByName(counters_, name);
+  if (it == counters_.end()) {
+    counters_.emplace_back(std::string{name}, value);
+  } else {
+    it->second += value;
+  }
+}
+
+int64_t Telemetry::counter(std::string_view name) const {
+  auto it = findByName(counters_, name);
+  return it != counters_.end() ? it->second : 0;
+}
+
+void Telemetry::merge(const Telemetry& other, const std::string& prefix) {
+  for (const auto& [name, stats] : other.stages_) {
+    auto& merged = stages_[stageIndex(prefix + name)].second;
+    merged.seconds_ += stats.seconds_;
+    merged.calls_ += stats.calls_;
+    merged.counted_ = merged.counted_ || stats.counted_;
+    for (int i = 0; i < kNumHardwareCounters; ++i) {
+      merged.hardware_[i] += stats.hardware_[i];
+    }
+  }
+  for (const auto& [name, value] : other.counters_) {
+    count(prefix + name, value);
+  }
+}
+
+std::string Telemetry::json() const {
+  std::ostringstream out;
+  out.precision(9);
+  bool counted = std::any_of(stages_.begin(), stages_.end(), [](const auto& stage) { return stage.second.counted_; });
+  out << "{\n  \"hardware_counters\": " << (counted ? "true" : "false") << ",\n  \"stages\": {";
+  for (int i = 0; i < stages_.size(); ++i) {
+    const auto& [name, stats] = stages_[i];
+    out << (i > 0 ? "," : "") << "\n    " << quoted(name) << ": {\"seconds\": " << stats.seconds_
+        << ", \"calls\": " << stats.calls_;
+    if (stats.counted_) {
+      for (int c = 0; c < kNumHardwareCounters; ++c) {
+        out << ", \"" << kHardwareCounterNames[c] << "\": " << stats.hardware_[c];
+      }
+    }
+    out << "}";
+  }
+  out << "\n  },\n  \"counters\": {";
+  for (int i = 0; i < counters_.size(); ++i) {
+    out << (i > 0 ? "," : "") << "\n    " << quoted(counters_[i].first) << ": " << counters_[i].second;
+  }
+  out << "\n  }\n}\n";
+  return out.str();
+}
+
+void Telemetry::enableHardwareCounters(bool enable) {
+  hardware_counters_enabled.store(enable, std::memory_order_relaxed);
+}
+
+ScopedStage::ScopedStage(Telemetry& telemetry, const char* name)
+    : span_{name}, telemetry_{telemetry}, stage_{telemetry.stageIndex(name)} {
+  counted_ = readHardwareCounters(hardware_start_);
+  start_ = std::chrono::steady_clock::now();
+}
+
+ScopedStage::~ScopedStage() {
+  auto end = std::chrono::steady_clock::now();
+  std::array<uint64_t, kNumHardwareCounters> hardware_end;
+  bool counted = counted_ && readHardwareCounters(hardware_end);
+  auto& stats = telemetry_.stages_[stage_].second;
+  stats.seconds_ += std::chrono::duration<double>(end - start_).count();
+  ++stats.calls_;
+  if (counted) {
+    stats.counted_ = true;
+    for (int i = 0; i < kNumHardwareCounters; ++i) {
+      stats.hardware_[i] += hardware_end[i] - hardware_start_[i];
+    }
+  }
+}
+
+void recordTelemetry(const std::string& prefix, const Telemetry& telemetry) {
+  std::lock_guard lock{recorded_mutex};
+  recorded.merge(telemetry, prefix);
+}
+
+bool saveTelemetry(const std::string& path) {
+  std::string json;
+  {
+    std::lock_guard lock{recorded_mutex};
+    json = recorded.json();
+  }
+  std::ofstream ofs{path};
+  ofs << json;
+  return static_cast<bool>(ofs);
+}
@@ -0,0 +1,89 @@
+#include "trace.h"
+
+#include <algorithm>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+struct TraceEvent {
+  const char* name;
+  int arg;
+  int64_t begin_ns;
+  int64_t end_ns;
+};
+
+// written by its thread only. head_ is published with release order after the event, so the saver reads whole events
+struct TraceRing {
+  explicit TraceRing(int tid) : tid_{tid}, events_(kTraceRingSize) {}
+
+  int tid_;
+  std::vector<TraceEvent> events_;
+  std::atomic<uint64_t> head_{0};
+};
+
+std::mutex rings_mutex;
+// rings outlive their threads, decode threads exit before the trace is saved
+std::vector<std::shared_ptr<TraceRing>> rings;
+int64_t trace_begin_ns = 0;
+
+TraceRing& threadRing() {
+  thread_local std::shared_ptr<TraceRing> ring = [] {
+    std::lock_guard lock{rings_mutex};
+    rings.push_back(std::make_shared<TraceRing>(rings.size()));
+    return rings.back();
+  }();
+  return *ring;
+}
+
+std::string quoted(const char* s) {
+  std::string result = "\"";
+  for (; *s != '\0'; ++s) {
+    if (*s == '"' || *s == '\\') {
+      result += '\\';
+    }
+    result += *s;
+  }
+  return result + "\"";
+}
+
+}  // namespace
+
+void Tracer::enable() {
+  trace_begin_ns = now();
+  enabled_.store(true, std::memory_order_relaxed);
+}
+
+void Tracer::record(const char* name, int arg, int64_t begin_ns, int64_t end_ns) {
+  auto& ring = threadRing();
+  uint64_t head = ring.head_.load(std::memory_order_relaxed);
+  ring.events_[head % kTraceRingSize] = TraceEvent{name, arg, begin_ns, end_ns};
+  ring.head_.store(head + 1, std::memory_order_release);
+}
+
+bool Tracer::save(const std::string& path) {
+  std::ofstream ofs{path};
+  ofs.precision(3);
+  ofs << std::fixed << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [";
+  bool first = true;
+  std::lock_guard lock{rings_mutex};
+  for (const auto& ring : rings) {
+    uint64_t head = ring->head_.load(std::memory_order_acquire);
+    for (uint64_t i = head - std::min<uint64_t>(head, kTraceRingSize); i < head; ++i) {
+      const auto& event = ring->events_[i % kTraceRingSize];
+      // trace-event timestamps are microseconds
+      ofs << (first ? "" : ",") << "\n  {\"name\": " << quoted(event.name) << ", \"ph\": \"X\", \"pid\": 1, \"tid\": "
+          << ring->tid_ << ", \"ts\": " << (event.begin_ns - trace_begin_ns) / 1e3
+          << ", \"dur\": " << (event.end_ns - event.begin_ns) / 1e3;
+      if (event.arg >= 0) {
+        ofs << ", \"args\": {\"n\": " << event.arg << "}";
+      }
+      ofs << "}";
+      first = false;
+    }
+  }
+  ofs << "\n]}\n";
+  return static_cast<bool>(ofs);
+}